@@ -1,4 +1,5 @@
 #include "CalibrationCV.h"
+#include "preview.h"
 #include "sys/stat.h"
 
 
@@ -71,8 +72,7 @@ CalibrationCV::CalibrationCV(BVS::ModuleInfo info, const BVS::Info& bvs)
 
 	if (!useCalibrationFile.empty()) calibrated = loadCalibrationFrom(directory, useCalibrationFile);
 	if (!calibrated && !useSavedImages) detectionThread = std::thread(&CalibrationCV::detectCalibrationPoints, this);
-	if (!(calibrated || useSavedImages))
-		for (auto& node: nodes) cv::namedWindow(info.id+"_"+std::to_string(node->id));
+	if (!(calibrated || useSavedImages)) Preview::instance().configure(bvs);
 }
 
 
@@ -85,7 +85,10 @@ CalibrationCV::~CalibrationCV()
 		detectionThread.join();
 	}
 
-	for (auto& it: nodes) delete it;
+	for (auto& it: nodes) {
+		Preview::instance().close(info.id+"_"+std::to_string(it->id));
+		delete it;
+	}
 }
 
 
@@ -118,10 +121,10 @@ BVS::Status CalibrationCV::execute()
 						cv::FONT_HERSHEY_SIMPLEX, 1.0f, cv::Scalar(0, 0, 255), 2);
 				cv::putText(*node->output, std::to_string(numDetections) + "/" + std::to_string(numImages),
 						cv::Point(100, 30), cv::FONT_HERSHEY_SIMPLEX, 1.0f, cv::Scalar(0, 255, 0), 2, 8);
-				cv::imshow(info.id+"_"+std::to_string(node->id), *node->output);
-				if (calibrated) cv::destroyWindow(std::to_string(node->id));
+				if (calibrated) Preview::instance().close(info.id+"_"+std::to_string(node->id));
+				else Preview::instance().show(info.id+"_"+std::to_string(node->id), *node->output);
 			}
-			char c = cv::waitKey(1);
+			int c = Preview::instance().key(info.id+"_"+std::to_string(nodes[0]->id));
 			if (c==27) return BVS::Status::SHUTDOWN;
 			if (autoShotDelay==0 && c==' ') notifyDetectionThread();
 		}
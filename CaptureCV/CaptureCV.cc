@@ -1,4 +1,6 @@
 #include "CaptureCV.h"
+#include "preview.h"
+#include <algorithm>
 #include <functional>
 
 
@@ -9,8 +11,12 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 	, logger(info.id)
 	, bvs(_bvs)
 	, outputs()
+	, outputsSmall()
 	, inputs()
 	, folder("folder", BVS::ConnectorType::INPUT)
+	, timestamps("timestamps", BVS::ConnectorType::OUTPUT)
+	, inTimestamps("inTimestamps", BVS::ConnectorType::INPUT)
+	, seek("seek", BVS::ConnectorType::INPUT)
 	, captures()
 	, writers()
 	, numNodes(bvs.config.getValue<int>(info.conf+".numNodes", 0))
@@ -31,24 +37,90 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 	, fourcc()
 	, recordFPS(bvs.config.getValue<double>(info.conf+".recordFPS", 0.0))
 	, recordColor(bvs.config.getValue<bool>(info.conf+".recordColor", true))
+	, captureBuffers(bvs.config.getValue<int>(info.conf+".captureBuffers", 3))
+	, captureLatest(bvs.config.getValue<std::string>(info.conf+".captureRead", "LATEST").at(0)!='N')
+	, captureDrop(bvs.config.getValue<std::string>(info.conf+".captureDrop", "OLDEST").at(0)=='N' ? FrameRing::Drop::NEWEST : FrameRing::Drop::OLDEST)
+	, captureWait(bvs.config.getValue<bool>(info.conf+".captureWait", false))
+	, videoReadAhead(bvs.config.getValue<int>(info.conf+".videoReadAhead", 4))
+	, decodeScale(bvs.config.getValue<int>(info.conf+".decodeScale", 1))
+	, decodeGrey(bvs.config.getValue<bool>(info.conf+".decodeGrey", false))
+	, smallOutputs(bvs.config.getValue<bool>(info.conf+".smallOutputs", false))
+	, rings()
+	, captureThreads()
+	, captureExit(false)
+	, frameStamps()
+	, syncMode(bvs.config.getValue<bool>(info.conf+".syncMode", false))
+	, syncTolerance(1000*bvs.config.getValue<double>(info.conf+".syncTolerance", 5.0))
+	, syncTimeout(1000*bvs.config.getValue<double>(info.conf+".syncTimeout", 100.0))
+	, syncSets(0)
+	, syncUnmatched(0)
+	, syncDuplicated(0)
+	, syncSkewSum(0.0)
+	, syncSkewMax(0)
+	, prefetchDepth(bvs.config.getValue<int>(info.conf+".prefetchDepth", 4))
+	, prefetchNext(0)
+	, prefetchExit(false)
+	, prefetched()
+	, prefetchTasks()
+	, prefetchThreads()
+	, prefetchMutex()
+	, prefetchWork()
+	, prefetchDone()
+	, writeQueueSize(bvs.config.getValue<int>(info.conf+".writeQueue", 8))
+	, writePolicy(bvs.config.getValue<std::string>(info.conf+".writePolicy", "BLOCK"))
+	, writeQueues()
+	, rawFile(bvs.config.getValue<std::string>(info.conf+".rawFile", "recording.bvsraw"))
+	, rawWriter()
+	, rawReader()
+	, playbackPosition(bvs.config.getValue<int>(info.conf+".playbackStart", 0))
+	, playbackRealtime(bvs.config.getValue<bool>(info.conf+".playbackRealtime", false))
+	, playbackFPS(bvs.config.getValue<double>(info.conf+".playbackFPS", 0.0))
+	, playbackDrop(bvs.config.getValue<bool>(info.conf+".playbackDrop", true))
+	, pacing(false)
+	, playbackLoop(bvs.config.getValue<bool>(info.conf+".playbackLoop", false))
+	, lastSeek(-1)
+	, playbackOrigin(-1)
+	, playbackClock()
+	, playbackLast(0)
+	, playbackIndex(0)
+	, playbackDelivered(0)
+	, playbackDropped(0)
+	, playbackReport()
 {
 	if (numNodes==0) LOG(0, "Number of nodes not set!");
+	if (displayMode) Preview::instance().configure(bvs);
+	if (decodeScale!=1 && decodeScale!=2 && decodeScale!=4 && decodeScale!=8) {
+		LOG(0, "decodeScale must be 1, 2, 4 or 8, using 1!");
+		decodeScale = 1;
+	}
+	if (decodeScale==1 && !decodeGrey) smallOutputs = false;
+	pacing = (mode=='V' || mode=='I' || mode=='P') && (playbackFPS>0 || playbackRealtime);
+	if (pacing && mode=='I' && playbackFPS<=0) {
+		LOG(1, "Images have no recorded times, set playbackFPS for paced playback!");
+		pacing = false;
+	}
 
 	// support functions
 	std::function<void()> enableOutputs = [&]() {
 		for (int i=0; i<numNodes; i++) {
 			outputs.emplace_back(new BVS::Connector<cv::Mat>("out"+std::to_string(i+1), BVS::ConnectorType::OUTPUT));
-			if (displayMode) cv::namedWindow("out"+std::to_string(i+1));
+			if (smallOutputs) outputsSmall.emplace_back(new BVS::Connector<cv::Mat>("out"+std::to_string(i+1)+"_small", BVS::ConnectorType::OUTPUT));
 		}
-		if (displayMode) cv::startWindowThread();
 	};
 
 	std::function<void()> enableInputs = [&]() {
-		for (int i=0; i<numNodes; i++) {
+		for (int i=0; i<numNodes; i++)
 			inputs.emplace_back(new BVS::Connector<cv::Mat>("in"+std::to_string(i+1), BVS::ConnectorType::INPUT));
-			if (displayMode) cv::namedWindow("in"+std::to_string(i+1));
+	};
+
+	std::function<void()> startWriters = [&]() {
+		if (writePolicy!="BLOCK" && writePolicy!="DROP_OLDEST" && writePolicy!="DROP_NEWEST") {
+			LOG(0, "Unknown writePolicy: '" << writePolicy << "', using BLOCK!");
+			writePolicy = "BLOCK";
 		}
-		if (displayMode) cv::startWindowThread(); // NOTE: shutdown segfault, GTK's icvWindowThreadLoop can't be joined/destroyed
+		if (writeQueueSize<=0) return;
+		for (int i=0; i<numNodes; i++) writeQueues.emplace_back(new WriteQueue());
+		for (int i=0; i<numNodes; i++) writeQueues.at(i)->thread = std::thread(&CaptureCV::writeLoop, this, i);
 	};
 
 	std::function<void()> getVideoFiles = [&]() {
@@ -80,6 +152,12 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 				if (cameraWidth>=0) captures.at(i).set(cv::CAP_PROP_FRAME_WIDTH, cameraWidth);
 				if (cameraHeight>=0) captures.at(i).set(cv::CAP_PROP_FRAME_HEIGHT, cameraHeight);
 				if (!captures.at(i).isOpened()) LOG(0, "Could not open camera: " << i << "!");
+				rings.emplace_back(new FrameRing(captureBuffers, captureDrop));
+			}
+			frameStamps.resize(numNodes, 0);
+			for (int i=0; i<numNodes; i++) {
+				if (captures.at(i).isOpened()) captureThreads.emplace_back(&CaptureCV::captureLoop, this, i);
+				else rings.at(i)->close();
 			}
 			break;
 		case 'V':
@@ -89,11 +167,21 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 				captures.emplace_back(cv::VideoCapture(videoFiles.at(i)));
 				if (captures.at(i).isOpened()) { LOG(2, "Use file '" << videoFiles.at(i) << "' as source for node: " << i+1); }
 				else { LOG(0, "Could not open '" << videoFiles.at(i) << "'!"); }
+				rings.emplace_back(new FrameRing(videoReadAhead, FrameRing::Drop::NONE));
+			}
+			frameStamps.resize(numNodes, 0);
+			for (int i=0; i<numNodes; i++) {
+				if (captures.at(i).isOpened()) captureThreads.emplace_back(&CaptureCV::captureLoop, this, i);
+				else rings.at(i)->close();
 			}
 			break;
 		case 'I':
 			enableOutputs();
 			parseImageFileName();
+			if (prefetchDepth>0) {
+				int threads = bvs.config.getValue<int>(info.conf+".prefetchThreads", 2);
+				for (int i=0; i<std::max(threads, 1); i++) prefetchThreads.emplace_back(&CaptureCV::prefetchLoop, this);
+			}
 			break;
 		case 'R':
 			enableInputs();
@@ -101,15 +189,29 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 			if (recordFOURCC.length()!=4) { LOG(0, "RecordFOURCC length must be 4!"); }
 			else { fourcc = cv::VideoWriter::fourcc(recordFOURCC[0], recordFOURCC[1], recordFOURCC[2], recordFOURCC[3]); }
 			for (int i=0; i<numNodes; i++) writers.emplace_back(cv::VideoWriter());
+			startWriters();
 			break;
 		case 'S':
 			enableInputs();
 			parseImageFileName();
+			startWriters();
 			break;
 		case 'D':
 			displayMode = true;
 			enableInputs();
 			break;
+		case 'L':
+			enableInputs();
+			rawWriter.reset(new RawWriter((uint64_t)bvs.config.getValue<int>(info.conf+".rawPreallocate", 1024)<<20));
+			if (!rawWriter->open(rawFile, numNodes)) LOG(0, "Could not create '" << rawFile << "'!");
+			break;
+		case 'P':
+			enableOutputs();
+			frameStamps.resize(numNodes, 0);
+			rawReader.reset(new RawReader());
+			if (!rawReader->open(rawFile)) LOG(0, "Could not open '" << rawFile << "'!");
+			else if (rawReader->nodes()<numNodes) LOG(0, "'" << rawFile << "' only contains " << rawReader->nodes() << " node(s)!");
+			break;
 		default:
 			LOG(0, "Incorrect mode: '" << mode << "', aborting!");
 			break;
@@ -120,18 +222,49 @@ CaptureCV::CaptureCV(BVS::ModuleInfo info, const BVS::Info& _bvs)
 
 CaptureCV::~CaptureCV()
 {
+	captureExit = true;
+	for (auto& ring: rings) ring->close();
+	for (auto& thread: captureThreads) thread.join();
+	{
+		std::lock_guard<std::mutex> lock(prefetchMutex);
+		prefetchExit = true;
+	}
+	prefetchWork.notify_all();
+	for (auto& thread: prefetchThreads) thread.join();
+
+	// write all queued frames before closing the files
+	for (auto& queue: writeQueues) {
+		{
+			std::lock_guard<std::mutex> lock(queue->mutex);
+			queue->exit = true;
+		}
+		queue->work.notify_one();
+	}
+	for (size_t i=0; i<writeQueues.size(); i++) {
+		writeQueues.at(i)->thread.join();
+		LOG(2, "Node " << i+1 << ": " << writeQueues.at(i)->queued << " queued, " << writeQueues.at(i)->written << " written, " << writeQueues.at(i)->dropped << " dropped");
+	}
+	for (size_t i=0; i<rings.size(); i++)
+		LOG(2, "Node " << i+1 << ": " << rings.at(i)->numCaptured() << " captured, " << rings.at(i)->numDropped() << " dropped, " << rings.at(i)->numSkipped() << " skipped");
+
 	switch (mode) {
 		case 'C': case 'V': for (auto& cap: captures) if (cap.isOpened()) cap.release(); break;
 		case 'I': break;
 		case 'R': for (auto& wr: writers) if (wr.isOpened()) wr.release(); break;
 		case 'S': break;
 		case 'D': break;
+		case 'L': rawWriter->close(); break;
+		case 'P': rawReader->close(); break;
 		default: break;
 	}
 
-	if (displayMode) cv::destroyAllWindows();
+	if (displayMode) {
+		for (size_t i=0; i<outputs.size(); i++) Preview::instance().close("out"+std::to_string(i+1));
+		for (size_t i=0; i<inputs.size(); i++) Preview::instance().close("in"+std::to_string(i+1));
+	}
 	for (auto& in: inputs) delete in;
 	for (auto& out: outputs) delete out;
+	for (auto& out: outputsSmall) delete out;
 }
 
 
@@ -144,67 +277,114 @@ BVS::Status CaptureCV::execute()
 		if((**in).empty()) return BVS::Status::NOINPUT;
 	}
 
+	// frames are captured by the capture threads, only wait for and copy them
+	// here, nodes without a new frame keep their previous one
+	int fresh = 0;
+	bool finished = false;
+	if (mode=='C' && captureWait && !syncMode) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000);
+		for (auto& ring: rings) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now());
+			if (!ring->waitReady(std::max(left, std::chrono::milliseconds(0)))) {
+				LOG(1, "Waiting for camera frames!");
+				break;
+			}
+		}
+	}
+
 	for (auto& in: inputs) in->lockConnection();
 	for (auto& out: outputs) out->lockConnection();
+	for (auto& out: outputsSmall) out->lockConnection();
 
 	switch (mode) {
 		case 'C':
-			for (auto cap: captures) cap.grab();
+			if (syncMode) fresh = syncFrames();
 			for (int i=0; i<numNodes; i++) {
-				captures.at(i).retrieve(**outputs.at(i));
-				if (displayMode) cv::imshow("out"+std::to_string(i+1), **outputs.at(i));
+				if (!syncMode) {
+					if (!rings.at(i)->read(**outputs.at(i), frameStamps.at(i), captureLatest, smallOutput(i))) continue;
+					fresh++;
+				}
+				LOG(3, "Camera " << i << " frame @ " << frameStamps.at(i) << "us");
+				if (displayMode) Preview::instance().show("out"+std::to_string(i+1), **outputs.at(i));
 			}
+			if (fresh>0 && timestamps.active()) timestamps.send(frameStamps);
 			break;
 		case 'V':
-			for (int i=0; i<numNodes; i++) {
-				if (!captures.at(i).read(**outputs.at(i))) LOG(0, "Could not read from '" << videoFiles.at(i) << "'!");
-				if (displayMode) cv::imshow("out"+std::to_string(i+1), **outputs.at(i));
-			}
+			// late frames are still decoded (needed for inter frame codecs), but not sent
+			while (readVideoFrames() && pacing && !paceFrame(frameStamps.at(0))) { }
+			for (int i=0; i<numNodes; i++)
+				if (displayMode) Preview::instance().show("out"+std::to_string(i+1), **outputs.at(i));
+			if (timestamps.active()) timestamps.send(frameStamps);
 			break;
 		case 'I':
+			// late frames are skipped, prefetched ones are only saved from
+			// decoding if no decoder thread has picked them up yet
+			while (pacing && !paceFrame(0)) counterStart += stepSize;
+			if (prefetchDepth>0) {
+				readPrefetched();
+				for (int i=0; i<numNodes; i++)
+					if (displayMode) Preview::instance().show("out"+std::to_string(i+1), **outputs.at(i));
+				counterStart += stepSize;
+				break;
+			}
 			for (int i=0; i<numNodes; i++) {
 				std::string filename = getImageFileName(counterStart, i);
 				LOG(3, "loading: " << filename);
-				cv::Mat tmp = cv::imread(filename, -1);
+				cv::Mat tmp, small;
+				loadImage(filename, tmp, small);
 				if (tmp.empty()) LOG(0, "cannot open file: " << filename);
 				**outputs.at(i) = tmp;
-				if (displayMode) cv::imshow("out"+std::to_string(i+1), **outputs.at(i));
+				if (smallOutputs) **outputsSmall.at(i) = small;
+				if (displayMode) Preview::instance().show("out"+std::to_string(i+1), **outputs.at(i));
 			}
 			counterStart += stepSize;
 			break;
 		case 'R':
+		case 'S':
+			// encoding and disk access happen in the writer threads, only copy here
 			for (int i=0; i<numNodes; i++) {
-				if (!writers.at(i).isOpened()) {
-					LOG(2, videoFiles.at(i) << ":" << (**inputs.at(i)).cols << "x" << (**inputs.at(i)).rows << "@" << recordFPS << "fps(" << recordFOURCC << "," << (recordColor ? "COLOR" : "NOCOLOR") << ")");
-					writers.at(i).open(videoFiles.at(i), fourcc, recordFPS, cv::Size((**inputs.at(i)).cols, (**inputs.at(i)).rows), recordColor);
-					if (!writers.at(i).isOpened()) LOG(0, "Could not open writer for '" << videoFiles.at(i));
-				}
-				writers.at(i).write(**inputs.at(i));
-				if (displayMode) cv::imshow("in"+std::to_string(i+1), **inputs.at(i));
+				std::string filename = mode=='S' ? getImageFileName(counterStart, i) : videoFiles.at(i);
+				if (writeQueues.empty()) writeFrame(i, **inputs.at(i), filename);
+				else queueFrame(i, **inputs.at(i), filename);
+				if (displayMode) Preview::instance().show("in"+std::to_string(i+1), **inputs.at(i));
 			}
 			LOG(2, "Writing frame(s) to " << numNodes << " file(s)!");
+			for (size_t i=0; i<writeQueues.size(); i++) {
+				std::lock_guard<std::mutex> lock(writeQueues.at(i)->mutex);
+				LOG(3, "Node " << i+1 << ": " << writeQueues.at(i)->jobs.size() << " pending, " << writeQueues.at(i)->written << " written, " << writeQueues.at(i)->dropped << " dropped");
+			}
+			if (mode=='S') counterStart += stepSize;
 			break;
-		case 'S':
+		case 'D':
 			for (int i=0; i<numNodes; i++) {
-				std::string filename = getImageFileName(counterStart, i);
-				bool written = cv::imwrite(filename, **inputs.at(i));
-				if (!written) LOG(0, "Could not write to file '" << filename << "'!");
-				if (displayMode) cv::imshow("in"+std::to_string(i+1), **inputs.at(i));
+				if (displayMode) Preview::instance().show("in"+std::to_string(i+1), **inputs.at(i));
 			}
-			LOG(2, "Writing frame(s) to " << numNodes << " file(s)!");
-			counterStart += stepSize;
 			break;
-		case 'D':
+		case 'L': {
+			std::vector<cv::Mat> images;
+			std::vector<int64_t> stamps;
 			for (int i=0; i<numNodes; i++) {
-				if (displayMode) cv::imshow("in"+std::to_string(i+1), **inputs.at(i));
+				images.push_back(**inputs.at(i));
+				if (displayMode) Preview::instance().show("in"+std::to_string(i+1), **inputs.at(i));
 			}
+			if (!inTimestamps.receive(stamps) || (int)stamps.size()!=numNodes)
+				stamps.assign(numNodes, std::chrono::duration_cast<std::chrono::microseconds>
+						(std::chrono::steady_clock::now().time_since_epoch()).count());
+			if (!rawWriter->write(images, stamps)) LOG(0, "Could not record frame(s) to '" << rawFile << "'!");
+			break;
+		}
+		case 'P':
+			finished = !playRecord();
 			break;
 		default: break;
 	}
 
 	for (auto& in: inputs) in->unlockConnection();
 	for (auto& out: outputs) out->unlockConnection();
+	for (auto& out: outputsSmall) out->unlockConnection();
 
+	if (finished) return BVS::Status::SHUTDOWN;
+	if (mode=='C' && fresh==0) return BVS::Status::NOINPUT;
 	return BVS::Status::OK;
 }
 
@@ -239,6 +419,440 @@ std::string CaptureCV::getImageFileName(int frame, int nodeID)
 
 
 
+void CaptureCV::captureLoop(int nodeID)
+{
+	BVS::nameThisThread("capture"+std::to_string(nodeID+1));
+	cv::VideoCapture& capture = captures.at(nodeID);
+	FrameRing& ring = *rings.at(nodeID);
+	bool failed = false;
+	cv::Mat full;
+
+	while (!captureExit) {
+		// grab even if the ring is full, so the driver's queue never holds stale frames,
+		// video files instead wait for a free slot in beginWrite()
+		if (!capture.grab()) {
+			if (mode=='V') {
+				ring.close();
+				break;
+			}
+			if (!failed) LOG(0, "Could not grab from camera: " << nodeID << "!");
+			failed = true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		failed = false;
+		int64_t stamp = mode=='V' ? (int64_t)(1000*capture.get(cv::CAP_PROP_POS_MSEC))
+			: std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+		Frame* frame = ring.beginWrite();
+		if (frame==nullptr) continue;
+		// reduce here, in parallel per node, instead of in the consumers
+		bool retrieved = false;
+		if (decodeScale==1 && !decodeGrey) retrieved = capture.retrieve(frame->image);
+		else if (smallOutputs) {
+			retrieved = capture.retrieve(frame->image);
+			if (retrieved) reduce(frame->image, frame->small);
+		} else {
+			retrieved = capture.retrieve(full);
+			if (retrieved) reduce(full, frame->image);
+		}
+		if (retrieved) {
+			frame->stamp = stamp;
+			ring.commitWrite(frame);
+		} else ring.abortWrite(frame);
+	}
+}
+
+
+
+int CaptureCV::syncFrames()
+{
+	using namespace std::chrono;
+	steady_clock::time_point deadline = steady_clock::now() + microseconds(syncTimeout);
+	std::vector<bool> repeat(numNodes, false);
+	int64_t target = -1;
+	int64_t skew = 0;
+	bool matched = false;
+	int fresh = 0;
+
+	while (true) {
+		// reference time, the newest time all cameras have a (new or previous) frame for
+		int lagging = 0;
+		target = -1;
+		for (int i=0; i<numNodes; i++) {
+			int64_t newest = std::max(rings.at(i)->newestStamp(), frameStamps.at(i));
+			if (newest<=0) { target = -1; lagging = i; break; }
+			if (target<0 || newest<target) { target = newest; lagging = i; }
+		}
+
+		if (target>=0) {
+			int64_t first = target;
+			int64_t last = target;
+			fresh = 0;
+			for (int i=0; i<numNodes; i++) {
+				int64_t stamp = rings.at(i)->nearestStamp(target);
+				repeat.at(i) = stamp<0 || (frameStamps.at(i)>0 && std::abs(frameStamps.at(i)-target)<std::abs(stamp-target));
+				if (repeat.at(i)) stamp = frameStamps.at(i);
+				else fresh++;
+				first = std::min(first, stamp);
+				last = std::max(last, stamp);
+			}
+			skew = last-first;
+			if (fresh>0 && skew<=syncTolerance) { matched = true; break; }
+		}
+
+		steady_clock::time_point now = steady_clock::now();
+		if (now>=deadline) break;
+		rings.at(lagging)->waitNewer(target, duration_cast<microseconds>(deadline-now));
+	}
+
+	if (target<0 || fresh==0) {
+		LOG(1, "No synchronized frames within " << syncTimeout/1000 << "ms!");
+		return 0;
+	}
+
+	// deliver, even if unmatched, so a stalled camera does not stall everything
+	int64_t first = 0;
+	int64_t last = 0;
+	for (int i=0; i<numNodes; i++) {
+		if (repeat.at(i) || !rings.at(i)->readNearest(target, **outputs.at(i), frameStamps.at(i), smallOutput(i))) {
+			repeat.at(i) = true;
+			syncDuplicated++;
+		}
+		first = i==0 ? frameStamps.at(i) : std::min(first, frameStamps.at(i));
+		last = i==0 ? frameStamps.at(i) : std::max(last, frameStamps.at(i));
+	}
+	skew = last-first;
+	if (!matched) syncUnmatched++;
+
+	syncSets++;
+	syncSkewSum += skew;
+	syncSkewMax = std::max(syncSkewMax, skew);
+	if (syncSets==100) {
+		uint64_t skipped = 0;
+		for (auto& ring: rings) skipped += ring->numSkipped();
+		LOG(2, "Sync skew: mean " << syncSkewSum/syncSets/1000 << "ms, max " << syncSkewMax/1000.0 << "ms, "
+				<< syncUnmatched << " unmatched, " << syncDuplicated << " repeated, " << skipped << " dropped (total)");
+		syncSets = 0;
+		syncUnmatched = 0;
+		syncDuplicated = 0;
+		syncSkewSum = 0.0;
+		syncSkewMax = 0;
+	}
+
+	fresh = 0;
+	for (int i=0; i<numNodes; i++) if (!repeat.at(i)) fresh++;
+	return fresh;
+}
+
+
+
+void CaptureCV::readPrefetched()
+{
+	// names are built here, as the folder input is only read from this thread
+	std::vector<std::string> files;
+	for (int i=0; i<numNodes; i++) files.push_back(getImageFileName(counterStart, i));
+
+	std::unique_lock<std::mutex> lock(prefetchMutex);
+	// drop skipped frames and the images no decoder thread has started on
+	auto skipped = [&](const std::shared_ptr<ImageSet>& set){ return (set->frame-counterStart)*stepSize<0; };
+	while (!prefetched.empty() && skipped(prefetched.front())) prefetched.pop_front();
+	prefetchTasks.erase(std::remove_if(prefetchTasks.begin(), prefetchTasks.end(),
+				[&](const std::pair<std::shared_ptr<ImageSet>, int>& task){ return skipped(task.first); }), prefetchTasks.end());
+	if (prefetched.empty() || prefetched.front()->frame!=counterStart || prefetched.front()->files!=files) {
+		if (!prefetched.empty()) LOG(2, "Restarting prefetch at frame " << counterStart);
+		prefetched.clear();
+		prefetchTasks.clear();
+		prefetchNext = counterStart;
+	}
+
+	while ((int)prefetched.size()<prefetchDepth) {
+		std::shared_ptr<ImageSet> set(new ImageSet{prefetchNext, {}, std::vector<cv::Mat>(numNodes), std::vector<cv::Mat>(numNodes), numNodes});
+		if (prefetchNext==counterStart) set->files = files;
+		else {
+			lock.unlock();
+			for (int i=0; i<numNodes; i++) set->files.push_back(getImageFileName(prefetchNext, i));
+			lock.lock();
+		}
+		for (int i=0; i<numNodes; i++) prefetchTasks.emplace_back(set, i);
+		prefetched.push_back(set);
+		prefetchNext += stepSize;
+	}
+	prefetchWork.notify_all();
+
+	std::shared_ptr<ImageSet> set = prefetched.front();
+	prefetchDone.wait(lock, [&](){ return set->pending==0; });
+	prefetched.pop_front();
+	lock.unlock();
+
+	for (int i=0; i<numNodes; i++) {
+		if (set->images.at(i).empty()) LOG(0, "cannot open file: " << set->files.at(i));
+		**outputs.at(i) = set->images.at(i);
+		if (smallOutputs) **outputsSmall.at(i) = set->smalls.at(i);
+	}
+}
+
+
+
+void CaptureCV::prefetchLoop()
+{
+	BVS::nameThisThread("prefetch");
+	std::unique_lock<std::mutex> lock(prefetchMutex);
+	while (true) {
+		prefetchWork.wait(lock, [&](){ return prefetchExit || !prefetchTasks.empty(); });
+		if (prefetchExit) break;
+
+		std::shared_ptr<ImageSet> set = prefetchTasks.front().first;
+		int node = prefetchTasks.front().second;
+		prefetchTasks.pop_front();
+		std::string filename = set->files.at(node);
+		lock.unlock();
+
+		LOG(3, "loading: " << filename);
+		cv::Mat image, small;
+		loadImage(filename, image, small);
+
+		lock.lock();
+		set->images.at(node) = image;
+		set->smalls.at(node) = small;
+		set->pending--;
+		prefetchDone.notify_all();
+	}
+}
+
+
+
+bool CaptureCV::writeFrame(int nodeID, const cv::Mat& image, const std::string& filename)
+{
+	if (mode=='S') {
+		bool written = cv::imwrite(filename, image);
+		if (!written) LOG(0, "Could not write to file '" << filename << "'!");
+		return written;
+	}
+
+	cv::VideoWriter& writer = writers.at(nodeID);
+	if (!writer.isOpened()) {
+		LOG(2, filename << ":" << image.cols << "x" << image.rows << "@" << recordFPS << "fps(" << recordFOURCC << "," << (recordColor ? "COLOR" : "NOCOLOR") << ")");
+		writer.open(filename, fourcc, recordFPS, cv::Size(image.cols, image.rows), recordColor);
+		if (!writer.isOpened()) {
+			LOG(0, "Could not open writer for '" << filename);
+			return false;
+		}
+	}
+	writer.write(image);
+	return true;
+}
+
+
+
+void CaptureCV::queueFrame(int nodeID, const cv::Mat& image, const std::string& filename)
+{
+	WriteQueue& queue = *writeQueues.at(nodeID);
+	std::unique_lock<std::mutex> lock(queue.mutex);
+
+	if ((int)queue.jobs.size()>=writeQueueSize) {
+		if (writePolicy=="DROP_NEWEST") {
+			queue.dropped++;
+			return;
+		} else if (writePolicy=="DROP_OLDEST") {
+			queue.pool.push_back(queue.jobs.front().first);
+			queue.jobs.pop_front();
+			queue.dropped++;
+		} else {
+			queue.space.wait(lock, [&](){ return (int)queue.jobs.size()<writeQueueSize; });
+		}
+	}
+
+	// reuse a written frame's buffer, the input is only valid during this round
+	cv::Mat copy;
+	if (!queue.pool.empty()) {
+		copy = queue.pool.back();
+		queue.pool.pop_back();
+	}
+	lock.unlock();
+	image.copyTo(copy);
+	lock.lock();
+
+	queue.jobs.emplace_back(copy, filename);
+	queue.queued++;
+	queue.work.notify_one();
+}
+
+
+
+void CaptureCV::writeLoop(int nodeID)
+{
+	BVS::nameThisThread("writer"+std::to_string(nodeID+1));
+	WriteQueue& queue = *writeQueues.at(nodeID);
+	std::unique_lock<std::mutex> lock(queue.mutex);
+	while (true) {
+		queue.work.wait(lock, [&](){ return queue.exit || !queue.jobs.empty(); });
+		if (queue.jobs.empty()) break;
+
+		std::pair<cv::Mat, std::string> job = queue.jobs.front();
+		queue.jobs.pop_front();
+		queue.space.notify_one();
+		lock.unlock();
+
+		bool written = writeFrame(nodeID, job.first, job.second);
+
+		lock.lock();
+		if (written) queue.written++;
+		queue.pool.push_back(job.first);
+	}
+}
+
+
+
+bool CaptureCV::paceFrame(int64_t recorded)
+{
+	using namespace std::chrono;
+	int64_t media = playbackFPS>0 ? (int64_t)(playbackIndex*1000000/playbackFPS) : recorded;
+	playbackIndex++;
+
+	steady_clock::time_point now = steady_clock::now();
+	if (playbackOrigin<0 || media<playbackLast) {
+		playbackOrigin = media;
+		playbackClock = now;
+		playbackReport = now;
+		playbackLast = media;
+		playbackDelivered++;
+		return true;
+	}
+
+	// late if the following frame is due already
+	int64_t period = playbackFPS>0 ? (int64_t)(1000000/playbackFPS) : media-playbackLast;
+	steady_clock::time_point due = playbackClock + microseconds(media-playbackOrigin);
+	playbackLast = media;
+	if (playbackDrop && now>due+microseconds(period)) {
+		playbackDropped++;
+		return false;
+	}
+	std::this_thread::sleep_until(due);
+	playbackDelivered++;
+
+	double elapsed = duration<double>(now-playbackReport).count();
+	if (elapsed>=5.0) {
+		LOG(2, "Playback: " << playbackDelivered/elapsed << " fps, " << playbackDropped << " frame(s) dropped ("
+				<< 100.0*playbackDropped/(playbackDelivered+playbackDropped) << "%)");
+		playbackDelivered = 0;
+		playbackDropped = 0;
+		playbackReport = now;
+	}
+	return true;
+}
+
+
+
+bool CaptureCV::readVideoFrames()
+{
+	// decoded by the capture threads in order, so the next frame of each node has the same index
+	bool ended = false;
+	for (int i=0; i<numNodes; i++) {
+		FrameRing& ring = *rings.at(i);
+		while (!ring.read(**outputs.at(i), frameStamps.at(i), false, smallOutput(i)) && !ring.isClosed()) ring.waitReady(std::chrono::milliseconds(1000));
+		if (ring.isClosed() && !ring.read(**outputs.at(i), frameStamps.at(i), false, smallOutput(i))) {
+			LOG(0, "Could not read from '" << videoFiles.at(i) << "'!");
+			ended = true;
+		}
+	}
+	return !ended;
+}
+
+
+
+void CaptureCV::reduce(const cv::Mat& in, cv::Mat& out) const
+{
+	cv::Mat grey;
+	const cv::Mat* src = &in;
+	if (decodeGrey && in.channels()>1) {
+		int code = in.channels()==4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY;
+		if (decodeScale==1) {
+			cv::cvtColor(in, out, code);
+			return;
+		}
+		cv::cvtColor(in, grey, code);
+		src = &grey;
+	}
+
+	if (decodeScale==1) {
+		in.copyTo(out);
+		return;
+	}
+	cv::pyrDown(*src, out);
+	for (int scale=decodeScale/2; scale>1; scale/=2) cv::pyrDown(out, out);
+}
+
+
+
+void CaptureCV::loadImage(const std::string& filename, cv::Mat& image, cv::Mat& small) const
+{
+	// reduced color decoding would drop 16 bit depth and alpha, so reduce like
+	// the other modes
+	if (smallOutputs || !decodeGrey) {
+		image = cv::imread(filename, -1);
+		if (image.empty()) return;
+		if (smallOutputs) reduce(image, small);
+		else if (decodeScale>1) reduce(image, image);
+		return;
+	}
+
+	// let the decoder convert and reduce, e.g. libjpeg decodes the luma DCT
+	// blocks at 1/2, 1/4 or 1/8 directly
+	int flags = cv::IMREAD_GRAYSCALE;
+	switch (decodeScale) {
+		case 2: flags = cv::IMREAD_REDUCED_GRAYSCALE_2; break;
+		case 4: flags = cv::IMREAD_REDUCED_GRAYSCALE_4; break;
+		case 8: flags = cv::IMREAD_REDUCED_GRAYSCALE_8; break;
+	}
+	image = cv::imread(filename, flags);
+}
+
+
+
+bool CaptureCV::playRecord()
+{
+	int target;
+	if (seek.receive(target) && target!=lastSeek) {
+		lastSeek = target;
+		playbackPosition = target;
+		playbackOrigin = -1;
+	}
+
+	int64_t records = rawReader->size();
+	while (true) {
+		if (playbackPosition<0 || playbackPosition>=records) {
+			if (!playbackLoop || records==0 || rawReader->nodes()<numNodes) {
+				LOG(1, "End of recording '" << rawFile << "'!");
+				return false;
+			}
+			playbackPosition = 0;
+			playbackOrigin = -1;
+		}
+
+		// pace by the first node's capture times, skip late records
+		if (!pacing || paceFrame(rawReader->stamp(playbackPosition, 0))) break;
+		playbackPosition += stepSize;
+	}
+
+	// views into the mapping, no image data is copied unless reduced
+	for (int i=0; i<numNodes; i++) {
+		cv::Mat frame = rawReader->frame(playbackPosition, i);
+		if (smallOutputs) reduce(frame, **outputsSmall.at(i));
+		if (!smallOutputs && (decodeScale>1 || decodeGrey)) reduce(frame, **outputs.at(i));
+		else **outputs.at(i) = frame;
+		frameStamps.at(i) = rawReader->stamp(playbackPosition, i);
+		if (displayMode) Preview::instance().show("out"+std::to_string(i+1), **outputs.at(i));
+	}
+	if (timestamps.active()) timestamps.send(frameStamps);
+
+	playbackPosition += stepSize;
+	rawReader->prefetch(playbackPosition);
+	return true;
+}
+
+
+
 /** This calls a macro to create needed module utilities. */
 BVS_MODULE_UTILITIES(CaptureCV)
 
@@ -5,7 +5,15 @@
 #include "opencv2/core.hpp"
 #include "opencv2/highgui.hpp"
 #include "opencv2/videoio.hpp"
+#include "framering.h"
+#include "rawcontainer.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 
@@ -16,7 +24,9 @@
  *
  * Dependencies: opencv
  * Inputs: in<N>, where <N> is a node id starting with 1
- * Outputs: out<N>, where <N> is a node id starting with 1
+ * Outputs: out<N>, where <N> is a node id starting with 1,
+ *          out<N>_small (reduced frames, if smallOutputs is set),
+ *          timestamps (capture times of out<N>)
  * Configuration Options: please see CaptureCV.conf
  */
 class CaptureCV : public BVS::Module
@@ -47,12 +57,43 @@ class CaptureCV : public BVS::Module
 		BVS::Status debugDisplay();
 
 	private:
+		/** Images of all nodes for one frame number, decoded in background. */
+		struct ImageSet
+		{
+			int frame; /**< Frame number. */
+			std::vector<std::string> files; /**< File name per node. */
+			std::vector<cv::Mat> images; /**< Decoded image per node. */
+			std::vector<cv::Mat> smalls; /**< Reduced image per node, if smallOutputs is set. */
+			int pending; /**< Number of images not decoded yet. */
+		};
+
+		/** Bounded queue of frames to write for one node, served by its own thread. */
+		struct WriteQueue
+		{
+			WriteQueue() : jobs(), pool(), mutex(), work(), space(), thread(), exit(false), queued(0), written(0), dropped(0) { }
+
+			std::deque<std::pair<cv::Mat, std::string>> jobs; /**< Frames and file names to write. */
+			std::vector<cv::Mat> pool; /**< Written frames, their buffers are reused. */
+			std::mutex mutex; /**< Protects all members. */
+			std::condition_variable work; /**< Signals new jobs or exit. */
+			std::condition_variable space; /**< Signals taken jobs. */
+			std::thread thread; /**< Writer thread. */
+			bool exit; /**< Stop after writing all queued jobs. */
+			uint64_t queued; /**< Number of queued frames. */
+			uint64_t written; /**< Number of written frames. */
+			uint64_t dropped; /**< Number of frames dropped because of a full queue. */
+		};
+
 		const BVS::ModuleInfo info; /**< Your module metadata, set by framework. */
 		BVS::Logger logger; /**< Logger. */
 		const BVS::Info& bvs; /**< Framework info. */
 		std::vector<BVS::Connector<cv::Mat>*> outputs; /**< Output connectors. */
+		std::vector<BVS::Connector<cv::Mat>*> outputsSmall; /**< Reduced output connectors, if smallOutputs is set. */
 		std::vector<BVS::Connector<cv::Mat>*> inputs; /**< Input connectors. */
 		BVS::Connector<std::string> folder; /** Optional folder name input. */
+		BVS::Connector<std::vector<int64_t>> timestamps; /**< Capture time of the current frames (CAMERA/VIDEO/PLAYBACK mode, microseconds). */
+		BVS::Connector<std::vector<int64_t>> inTimestamps; /**< Optional capture time of the inputs (LOG_RAW mode). */
+		BVS::Connector<int> seek; /**< Optional record to jump to (PLAYBACK mode). */
 		std::vector<cv::VideoCapture> captures; /**< Captures vector for camera usage. */
 		std::vector<cv::VideoWriter> writers; /**< Writers vector for video output. */
 		int numNodes; /**< Number of nodes to use. */
@@ -73,6 +114,55 @@ class CaptureCV : public BVS::Module
 		int fourcc; /**< FOURCC value as integer representation. */
 		double recordFPS; /**< FPS to set in recorded videos. */
 		bool recordColor; /**< Record videos with color, or not. */
+		int captureBuffers; /**< Number of frames buffered per camera. */
+		bool captureLatest; /**< Take the latest buffered frame, otherwise the next one. */
+		FrameRing::Drop captureDrop; /**< Frame to drop when a camera's buffer is full. */
+		bool captureWait; /**< Wait for a new frame from each camera. */
+		int videoReadAhead; /**< Number of frames decoded ahead per video. */
+		int decodeScale; /**< Reduce frames by this factor (1, 2, 4, 8). */
+		bool decodeGrey; /**< Reduce frames to greyscale. */
+		bool smallOutputs; /**< Send reduced frames on out<N>_small and keep out<N> full size. */
+		std::vector<std::unique_ptr<FrameRing>> rings; /**< Frame buffer per camera. */
+		std::vector<std::thread> captureThreads; /**< Capture thread per camera. */
+		std::atomic<bool> captureExit; /**< Stop the capture threads. */
+		std::vector<int64_t> frameStamps; /**< Capture time of the current frames (microseconds). */
+		bool syncMode; /**< Match frames of all cameras by capture time. */
+		int64_t syncTolerance; /**< Maximum skew of a matched set (microseconds). */
+		int64_t syncTimeout; /**< Maximum time to wait for a matched set (microseconds). */
+		uint64_t syncSets; /**< Number of delivered sets since the last report. */
+		uint64_t syncUnmatched; /**< Sets delivered with a skew above the tolerance. */
+		uint64_t syncDuplicated; /**< Frames repeated because no closer new frame existed. */
+		double syncSkewSum; /**< Sum of the set skews since the last report. */
+		int64_t syncSkewMax; /**< Maximum set skew since the last report. */
+		int prefetchDepth; /**< Number of frames to decode ahead in IMAGE mode. */
+		int prefetchNext; /**< Next frame number to schedule for decoding. */
+		bool prefetchExit; /**< Stop the prefetch threads. */
+		std::deque<std::shared_ptr<ImageSet>> prefetched; /**< Scheduled frames in playback order. */
+		std::deque<std::pair<std::shared_ptr<ImageSet>, int>> prefetchTasks; /**< Images (frame, node) to decode. */
+		std::vector<std::thread> prefetchThreads; /**< Decoder threads. */
+		std::mutex prefetchMutex; /**< Protects prefetched, prefetchTasks and the sets. */
+		std::condition_variable prefetchWork; /**< Signals new tasks or exit. */
+		std::condition_variable prefetchDone; /**< Signals decoded images. */
+		int writeQueueSize; /**< Frames queued per node in SAVE_IMAGE/RECORD_VIDEO mode, 0 writes synchronously. */
+		std::string writePolicy; /**< Policy for a full write queue: BLOCK, DROP_OLDEST or DROP_NEWEST. */
+		std::vector<std::unique_ptr<WriteQueue>> writeQueues; /**< Write queue per node. */
+		std::string rawFile; /**< Raw container file for LOG_RAW/PLAYBACK mode. */
+		std::unique_ptr<RawWriter> rawWriter; /**< Raw container writer. */
+		std::unique_ptr<RawReader> rawReader; /**< Raw container reader. */
+		int64_t playbackPosition; /**< Next record to play back. */
+		bool playbackRealtime; /**< Pace playback by the recorded capture times. */
+		double playbackFPS; /**< Pace playback at this rate instead, 0 disables. */
+		bool playbackDrop; /**< Skip late frames when pacing, like a live camera. */
+		bool pacing; /**< Playback is paced. */
+		bool playbackLoop; /**< Restart playback at the end of the recording. */
+		int lastSeek; /**< Last record received on the seek input. */
+		int64_t playbackOrigin; /**< Capture time of the first paced record, -1 to restart pacing. */
+		std::chrono::steady_clock::time_point playbackClock; /**< Playback time of playbackOrigin. */
+		int64_t playbackLast; /**< Media time of the last paced frame. */
+		int64_t playbackIndex; /**< Number of paced frames, used with playbackFPS. */
+		uint64_t playbackDelivered; /**< Delivered frames since the last report. */
+		uint64_t playbackDropped; /**< Dropped frames since the last report. */
+		std::chrono::steady_clock::time_point playbackReport; /**< Time of the last report. */
 
 		/** Get filename using image name scheme.
 		 * @param[in] frame Frame number to use.
@@ -80,6 +170,88 @@ class CaptureCV : public BVS::Module
 		 */
 		std::string getImageFileName(int frame, int nodeID);
 
+		/** Capture thread, grabs frames from a camera or video into its ring.
+		 * @param[in] nodeID Node id to capture for.
+		 */
+		void captureLoop(int nodeID);
+
+		/** Select a set of frames with matching capture times from all cameras.
+		 * The reference time is the newest time all cameras have a frame for,
+		 * each camera contributes its frame closest to it, older frames are
+		 * dropped. If a camera's previous frame is closer than any new one it is
+		 * repeated. Waits (at most syncTimeout) for lagging cameras while the
+		 * skew exceeds syncTolerance.
+		 * @return Number of nodes with a new frame.
+		 */
+		int syncFrames();
+
+		/** Take the images of the current frame from the prefetch queue.
+		 * Schedules decoding of the following frames up to prefetchDepth and
+		 * waits only if the current frame is not decoded yet.
+		 */
+		void readPrefetched();
+
+		/** Prefetch thread, decodes scheduled images. */
+		void prefetchLoop();
+
+		/** Write a frame to a node's video or image file.
+		 * @param[in] nodeID Node id to write for.
+		 * @param[in] image Frame to write.
+		 * @param[in] filename Image file name (SAVE_IMAGE mode).
+		 * @return False on errors.
+		 */
+		bool writeFrame(int nodeID, const cv::Mat& image, const std::string& filename);
+
+		/** Hand a copy of a frame to a node's writer thread, applying writePolicy.
+		 * @param[in] nodeID Node id to write for.
+		 * @param[in] image Frame to write.
+		 * @param[in] filename Image file name (SAVE_IMAGE mode).
+		 */
+		void queueFrame(int nodeID, const cv::Mat& image, const std::string& filename);
+
+		/** Reduce a frame as configured by decodeScale and decodeGrey.
+		 * Uses the same pyramid as downstream modules (cv::pyrDown).
+		 * @param[in] in Full size frame.
+		 * @param[out] out Reduced frame.
+		 */
+		void reduce(const cv::Mat& in, cv::Mat& out) const;
+
+		/** Decode an image file, reduced if only reduced frames are needed.
+		 * @param[in] filename Image file name.
+		 * @param[out] image Decoded image, reduced unless smallOutputs is set.
+		 * @param[out] small Reduced image if smallOutputs is set.
+		 */
+		void loadImage(const std::string& filename, cv::Mat& image, cv::Mat& small) const;
+
+		/** Reduced output of a node.
+		 * @param[in] nodeID Node id.
+		 * @return Output data or nullptr if smallOutputs is not set.
+		 */
+		cv::Mat* smallOutput(int nodeID) { return outputsSmall.empty() ? nullptr : &**outputsSmall.at(nodeID); }
+
+		/** Pace playback, waits until a frame is due.
+		 * The media time is the recorded time, or derived from playbackFPS if
+		 * set. A backwards jump (loop, seek) restarts pacing.
+		 * @param[in] recorded Recorded time of the frame (microseconds).
+		 * @return False if the frame is late and should be skipped.
+		 */
+		bool paceFrame(int64_t recorded);
+
+		/** Read the next frame of each video.
+		 * @return False if a video ended.
+		 */
+		bool readVideoFrames();
+
+		/** Send the current record of the raw container and advance.
+		 * @return False at the end of the recording.
+		 */
+		bool playRecord();
+
+		/** Writer thread of a node.
+		 * @param[in] nodeID Node id to write for.
+		 */
+		void writeLoop(int nodeID);
+
 		CaptureCV(const CaptureCV&) = delete; /**< -Weffc++ */
 		CaptureCV& operator=(const CaptureCV&) = delete; /**< -Weffc++ */
 };
@@ -0,0 +1,318 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+#include "opencv2/core.hpp"
+
+
+
+/** Captured frame with its meta data. */
+struct Frame
+{
+	/** Frame constructor. */
+	Frame() : image(), small(), stamp(0), seq(0) { }
+
+	cv::Mat image; /**< Image data, buffer is reused between captures. */
+	cv::Mat small; /**< Optional reduced image, buffer is reused between captures. */
+	std::atomic<int64_t> stamp; /**< Capture time in microseconds (steady clock). */
+	std::atomic<uint64_t> seq; /**< Sequence number, increases with every committed frame. */
+};
+
+
+
+/** Single producer, single consumer ring of preallocated frames.
+ * The producer (a capture thread) and the consumer (execute()) hand slots to
+ * each other through per slot states only, so neither side ever waits for
+ * the other while copying image data. The consumer holds at most one slot
+ * at a time, so with at least two slots the producer always finds one to
+ * write to when dropping the oldest frame.
+ */
+class FrameRing
+{
+	public:
+		/** Policy when all slots hold unread frames, NONE makes the producer wait. */
+		enum class Drop { OLDEST, NEWEST, NONE };
+
+		/** FrameRing constructor.
+		 * @param[in] size Number of slots, at least 2.
+		 * @param[in] drop Policy when the ring is full.
+		 */
+		FrameRing(size_t size, Drop drop)
+			: slots(std::max<size_t>(size, 2)),
+			states(new std::atomic<int>[slots.size()]),
+			drop(drop),
+			writeSeq(0),
+			lastRead(0),
+			captured(0),
+			dropped(0),
+			skipped(0),
+			closed(false),
+			waitMutex(),
+			waitSignal()
+		{
+			for (size_t i=0; i<slots.size(); i++) states[i].store(FREE);
+		}
+
+		/** FrameRing destructor. */
+		~FrameRing() { delete[] states; }
+
+		/** Get a slot to write the next frame to (producer only).
+		 * @return Slot or nullptr if the ring is full and newest frames are
+		 * dropped, or if the ring was closed while waiting for a free slot.
+		 */
+		Frame* beginWrite()
+		{
+			captured++;
+			while (true) {
+				for (size_t i=0; i<slots.size(); i++) {
+					int expected = FREE;
+					if (states[i].compare_exchange_strong(expected, WRITING)) return &slots[i];
+				}
+
+				if (drop == Drop::NONE) {
+					std::unique_lock<std::mutex> lock(waitMutex);
+					waitSignal.wait(lock, [&](){ return closed || find(FREE, false)>=0; });
+					if (closed) return nullptr;
+					continue;
+				}
+
+				dropped++;
+				if (drop == Drop::NEWEST) return nullptr;
+
+				// steal the oldest unread frame, retry if the consumer took it meanwhile
+				int oldest = find(READY, false);
+				int expected = READY;
+				if (oldest>=0 && states[oldest].compare_exchange_strong(expected, WRITING)) return &slots[oldest];
+				dropped--;
+			}
+		}
+
+		/** Publish a written slot (producer only).
+		 * @param[in] frame Slot returned by beginWrite().
+		 */
+		void commitWrite(Frame* frame)
+		{
+			frame->seq = ++writeSeq;
+			states[frame-slots.data()].store(READY, std::memory_order_release);
+			signal();
+		}
+
+		/** Mark the end of the stream or wake up a waiting producer to stop.
+		 * Unread frames can still be read afterwards.
+		 */
+		void close()
+		{
+			closed = true;
+			signal();
+		}
+
+		/** Whether close() was called. */
+		bool isClosed() const { return closed; }
+
+		/** Return a slot without publishing it, e.g. on capture errors (producer only).
+		 * @param[in] frame Slot returned by beginWrite().
+		 */
+		void abortWrite(Frame* frame)
+		{
+			states[frame-slots.data()].store(FREE, std::memory_order_release);
+		}
+
+		/** Copy a frame out of the ring (consumer only).
+		 * @param[out] image Destination, its buffer is reused if possible.
+		 * @param[out] stamp Capture time of the frame.
+		 * @param[in] latest Take the newest frame and discard older ones, or the oldest.
+		 * @param[out] small Optional destination of the reduced image.
+		 * @return False if there is no unread frame.
+		 */
+		bool read(cv::Mat& image, int64_t& stamp, bool latest, cv::Mat* small = nullptr)
+		{
+			while (true) {
+				int index = find(READY, latest);
+				if (index<0) return false;
+				int expected = READY;
+				if (!states[index].compare_exchange_strong(expected, READING)) continue;
+
+				// the scan is not atomic, an older frame may have been committed or
+				// the slot refilled meanwhile, so check again while holding the slot
+				Frame& frame = slots[index];
+				int older = latest ? -1 : find(READY, false);
+				if (older>=0 && slots[older].seq<frame.seq) {
+					states[index].store(READY, std::memory_order_release);
+					continue;
+				}
+
+				frame.image.copyTo(image);
+				if (small) frame.small.copyTo(*small);
+				stamp = frame.stamp;
+				lastRead = frame.seq;
+				states[index].store(FREE, std::memory_order_release);
+
+				if (latest) skipOlder();
+				if (drop == Drop::NONE) signal();
+				return true;
+			}
+		}
+
+		/** Copy the frame captured closest to a given time out of the ring and
+		 * discard older ones (consumer only).
+		 * @param[in] target Capture time to match.
+		 * @param[out] image Destination, its buffer is reused if possible.
+		 * @param[out] stamp Capture time of the frame.
+		 * @param[out] small Optional destination of the reduced image.
+		 * @return False if there is no unread frame.
+		 */
+		bool readNearest(int64_t target, cv::Mat& image, int64_t& stamp, cv::Mat* small = nullptr)
+		{
+			while (true) {
+				int index = nearest(target);
+				if (index<0) return false;
+				int expected = READY;
+				if (!states[index].compare_exchange_strong(expected, READING)) continue;
+
+				// the slot may have been refilled meanwhile
+				Frame& frame = slots[index];
+				int other = nearest(target);
+				if (other>=0 && std::abs(slots[other].stamp-target)<std::abs(frame.stamp-target)) {
+					states[index].store(READY, std::memory_order_release);
+					continue;
+				}
+
+				frame.image.copyTo(image);
+				if (small) frame.small.copyTo(*small);
+				stamp = frame.stamp;
+				lastRead = frame.seq;
+				states[index].store(FREE, std::memory_order_release);
+				skipOlder();
+				return true;
+			}
+		}
+
+		/** Capture time of the newest unread frame (consumer only).
+		 * @return Capture time or -1 if there is no unread frame.
+		 */
+		int64_t newestStamp() const
+		{
+			int index = find(READY, true);
+			return index<0 ? -1 : slots[index].stamp.load();
+		}
+
+		/** Capture time of the unread frame closest to a given time (consumer only).
+		 * @param[in] target Capture time to match.
+		 * @return Capture time or -1 if there is no unread frame.
+		 */
+		int64_t nearestStamp(int64_t target) const
+		{
+			int index = nearest(target);
+			return index<0 ? -1 : slots[index].stamp.load();
+		}
+
+		/** Wait until an unread frame is available (consumer only).
+		 * @param[in] timeout Maximum time to wait.
+		 * @return False on timeout.
+		 */
+		bool waitReady(std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(waitMutex);
+			return waitSignal.wait_for(lock, timeout, [&](){ return closed || find(READY, false)>=0; });
+		}
+
+		/** Wait until an unread frame newer than a given time is available (consumer only).
+		 * @param[in] stamp Capture time the frame must be newer than.
+		 * @param[in] timeout Maximum time to wait.
+		 * @return False on timeout.
+		 */
+		bool waitNewer(int64_t stamp, std::chrono::microseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(waitMutex);
+			return waitSignal.wait_for(lock, timeout, [&](){ return newestStamp()>stamp; });
+		}
+
+		/** Number of frames captured, including dropped ones. */
+		uint64_t numCaptured() const { return captured; }
+
+		/** Number of frames dropped because the ring was full. */
+		uint64_t numDropped() const { return dropped; }
+
+		/** Number of unread frames skipped by reading a newer frame. */
+		uint64_t numSkipped() const { return skipped; }
+
+	private:
+		enum { FREE, WRITING, READY, READING };
+
+		std::vector<Frame> slots; /**< Preallocated frames. */
+		std::atomic<int>* states; /**< Slot states. */
+		const Drop drop; /**< Policy when the ring is full. */
+		uint64_t writeSeq; /**< Last committed sequence number (producer). */
+		uint64_t lastRead; /**< Last read sequence number (consumer). */
+		std::atomic<uint64_t> captured; /**< Captured frame counter. */
+		std::atomic<uint64_t> dropped; /**< Dropped frame counter. */
+		std::atomic<uint64_t> skipped; /**< Skipped frame counter. */
+		std::atomic<bool> closed; /**< End of stream or shutdown. */
+		std::mutex waitMutex; /**< Only used to wait for frames or free slots, never while copying. */
+		std::condition_variable waitSignal; /**< Signals committed or freed frames. */
+
+		/** Wake up the other side, locking avoids lost wakeups. */
+		void signal()
+		{
+			{ std::lock_guard<std::mutex> lock(waitMutex); }
+			waitSignal.notify_all();
+		}
+
+		/** Find the slot in the given state with the lowest/highest sequence number.
+		 * @param[in] state Slot state.
+		 * @param[in] newest Search for the highest sequence number.
+		 * @return Slot index or -1.
+		 */
+		int find(int state, bool newest) const
+		{
+			int index = -1;
+			for (size_t i=0; i<slots.size(); i++) {
+				if (states[i].load(std::memory_order_acquire)!=state) continue;
+				if (index<0 || (newest ? slots[i].seq>slots[index].seq : slots[i].seq<slots[index].seq)) index = i;
+			}
+			return index;
+		}
+
+		/** Find the unread slot captured closest to a given time.
+		 * @param[in] target Capture time to match.
+		 * @return Slot index or -1.
+		 */
+		int nearest(int64_t target) const
+		{
+			int index = -1;
+			int64_t best = 0;
+			for (size_t i=0; i<slots.size(); i++) {
+				if (states[i].load(std::memory_order_acquire)!=READY) continue;
+				int64_t distance = std::abs(slots[i].stamp-target);
+				if (index<0 || distance<best) { index = i; best = distance; }
+			}
+			return index;
+		}
+
+		/** Discard unread frames older than the last read one. */
+		void skipOlder()
+		{
+			// claim before checking, the producer may refill a slot meanwhile
+			for (size_t i=0; i<slots.size(); i++) {
+				int expected = READY;
+				if (!states[i].compare_exchange_strong(expected, READING)) continue;
+				bool older = slots[i].seq<lastRead;
+				if (older) skipped++;
+				states[i].store(older ? FREE : READY, std::memory_order_release);
+			}
+		}
+
+		FrameRing(const FrameRing&) = delete; /**< -Weffc++ */
+		FrameRing& operator=(const FrameRing&) = delete; /**< -Weffc++ */
+};
+
+
+
+#endif //FRAME_RING_H
@@ -0,0 +1,303 @@
+#include "rawcontainer.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+
+namespace {
+	const char dataMagic[8] = {'B', 'V', 'S', 'R', 'A', 'W', '1', '\0'}; /**< Data file magic. */
+	const char indexMagic[8] = {'B', 'V', 'S', 'I', 'D', 'X', '1', '\0'}; /**< Index file magic. */
+	const uint64_t headerSize = 4096; /**< Data file header size, also the image alignment. */
+	const uint64_t indexHeaderSize = 16; /**< Index file header size (magic, number of nodes). */
+	const int maxNodes = (headerSize-32)/sizeof(RawNodeFormat); /**< Node formats fitting the header. */
+
+	/** Data file header, followed by the node formats. */
+	struct RawHeader
+	{
+		char magic[8];
+		uint32_t numNodes;
+		uint32_t reserved;
+		uint64_t recordSize;
+		uint64_t reserved2;
+	};
+
+	uint64_t alignUp(uint64_t size) { return (size+headerSize-1)/headerSize*headerSize; }
+}
+
+
+
+RawWriter::RawWriter(uint64_t preallocate)
+	: logger("RawWriter")
+	, preallocate(preallocate)
+	, file()
+	, dataFD(-1)
+	, indexFD(-1)
+	, formats()
+	, recordSize(0)
+	, records(0)
+	, allocated(0)
+	, entry()
+{ }
+
+
+
+RawWriter::~RawWriter()
+{
+	close();
+}
+
+
+
+bool RawWriter::open(const std::string& file, int numNodes)
+{
+	close();
+	if (numNodes<1 || numNodes>maxNodes) {
+		LOG(0, "Unsupported number of nodes for raw container: " << numNodes << "!");
+		return false;
+	}
+
+	this->file = file;
+	dataFD = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	indexFD = ::open((file+".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (dataFD<0 || indexFD<0) {
+		LOG(0, "Could not create raw container '" << file << "'!");
+		close();
+		return false;
+	}
+
+	char header[indexHeaderSize] = {};
+	std::memcpy(header, indexMagic, sizeof(indexMagic));
+	std::memcpy(header+sizeof(indexMagic), &numNodes, sizeof(numNodes));
+	if (::write(indexFD, header, sizeof(header))!=sizeof(header)) {
+		LOG(0, "Could not write index of '" << file << "'!");
+		close();
+		return false;
+	}
+
+	formats.resize(numNodes);
+	entry.resize(sizeof(int64_t)*(1+numNodes));
+	recordSize = 0;
+	records = 0;
+	allocated = 0;
+	return true;
+}
+
+
+
+bool RawWriter::write(const std::vector<cv::Mat>& images, const std::vector<int64_t>& stamps)
+{
+	if (dataFD<0 || images.size()!=formats.size() || stamps.size()!=formats.size()) return false;
+
+	for (const auto& image: images) if (image.empty()) return false;
+
+	// the first record defines the layout
+	if (recordSize==0) {
+		std::vector<char> header(headerSize, 0);
+		RawHeader* h = reinterpret_cast<RawHeader*>(header.data());
+		std::memcpy(h->magic, dataMagic, sizeof(dataMagic));
+		h->numNodes = formats.size();
+		for (size_t i=0; i<formats.size(); i++) {
+			const cv::Mat& image = images.at(i);
+			formats.at(i) = RawNodeFormat{image.rows, image.cols, image.type(), 0, image.cols*image.elemSize(), recordSize};
+			recordSize += alignUp(formats.at(i).step*image.rows);
+		}
+		h->recordSize = recordSize;
+		std::memcpy(header.data()+sizeof(RawHeader), formats.data(), formats.size()*sizeof(RawNodeFormat));
+		if (pwrite(dataFD, header.data(), headerSize, 0)!=(ssize_t)headerSize) {
+			LOG(0, "Could not write header of '" << file << "'!");
+			recordSize = 0;
+			return false;
+		}
+		allocated = headerSize;
+	}
+
+	uint64_t offset = headerSize + records*recordSize;
+	if (offset+recordSize>allocated) {
+		uint64_t grow = std::max(preallocate, recordSize);
+		if (posix_fallocate(dataFD, allocated, grow)==0) allocated += grow;
+		else allocated = offset+recordSize; // filesystem without preallocation, just append
+	}
+
+	// one vectored write for the whole record, rows of non continuous images and padding as separate parts
+	static const std::vector<char> padding(headerSize, 0);
+	std::vector<iovec> parts;
+	for (size_t i=0; i<formats.size(); i++) {
+		const cv::Mat& image = images.at(i);
+		const RawNodeFormat& format = formats.at(i);
+		if (image.rows!=format.rows || image.cols!=format.cols || image.type()!=format.type) {
+			LOG(0, "Node " << i+1 << " frame format changed, cannot record to '" << file << "'!");
+			return false;
+		}
+		if (image.isContinuous()) parts.push_back(iovec{image.data, format.step*format.rows});
+		else for (int r=0; r<image.rows; r++) parts.push_back(iovec{const_cast<uchar*>(image.ptr(r)), format.step});
+		uint64_t pad = alignUp(format.step*format.rows) - format.step*format.rows;
+		if (pad>0) parts.push_back(iovec{const_cast<char*>(padding.data()), pad});
+	}
+
+	uint64_t done = 0;
+	size_t first = 0;
+	while (first<parts.size()) {
+		size_t count = std::min<size_t>(parts.size()-first, IOV_MAX);
+		ssize_t n = pwritev(dataFD, parts.data()+first, count, offset+done);
+		if (n<0) {
+			LOG(0, "Could not write to '" << file << "'!");
+			return false;
+		}
+		done += n;
+		// skip completely written parts, adjust a partially written one
+		while (first<parts.size() && (size_t)n>=parts.at(first).iov_len) n -= parts.at(first++).iov_len;
+		if (first<parts.size() && n>0) {
+			parts.at(first).iov_base = static_cast<char*>(parts.at(first).iov_base)+n;
+			parts.at(first).iov_len -= n;
+		}
+	}
+
+	int64_t* e = reinterpret_cast<int64_t*>(entry.data());
+	e[0] = offset;
+	std::copy(stamps.begin(), stamps.end(), e+1);
+	if (::write(indexFD, entry.data(), entry.size())!=(ssize_t)entry.size()) {
+		LOG(0, "Could not write index of '" << file << "'!");
+		return false;
+	}
+
+	records++;
+	return true;
+}
+
+
+
+void RawWriter::close()
+{
+	if (dataFD>=0) {
+		if (recordSize>0 && ftruncate(dataFD, headerSize + records*recordSize)!=0) LOG(0, "Could not truncate '" << file << "'!");
+		::close(dataFD);
+		LOG(2, "Closed '" << file << "' after " << records << " record(s)");
+	}
+	if (indexFD>=0) ::close(indexFD);
+	dataFD = -1;
+	indexFD = -1;
+}
+
+
+
+RawReader::RawReader()
+	: logger("RawReader")
+	, data(nullptr)
+	, dataSize(0)
+	, index(nullptr)
+	, indexSize(0)
+	, formats()
+	, recordSize(0)
+	, records(0)
+{ }
+
+
+
+RawReader::~RawReader()
+{
+	close();
+}
+
+
+
+bool RawReader::open(const std::string& file)
+{
+	close();
+
+	// map both files, private mappings keep the recording intact if frames are modified downstream
+	auto map = [&](const std::string& name, char*& ptr, size_t& size) {
+		int fd = ::open(name.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd<0 || fstat(fd, &st)!=0 || st.st_size==0) {
+			if (fd>=0) ::close(fd);
+			return false;
+		}
+		void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (p==MAP_FAILED) return false;
+		ptr = static_cast<char*>(p);
+		size = st.st_size;
+		return true;
+	};
+
+	if (!map(file, data, dataSize) || !map(file+".idx", index, indexSize)
+			|| dataSize<headerSize || indexSize<indexHeaderSize
+			|| std::memcmp(data, dataMagic, sizeof(dataMagic))!=0
+			|| std::memcmp(index, indexMagic, sizeof(indexMagic))!=0) {
+		LOG(0, "Could not open raw container '" << file << "'!");
+		close();
+		return false;
+	}
+
+	const RawHeader* h = reinterpret_cast<const RawHeader*>(data);
+	if (h->numNodes<1 || (int)h->numNodes>maxNodes) {
+		LOG(0, "Corrupt raw container '" << file << "'!");
+		close();
+		return false;
+	}
+	const RawNodeFormat* f = reinterpret_cast<const RawNodeFormat*>(data+sizeof(RawHeader));
+	formats.assign(f, f+h->numNodes);
+	recordSize = h->recordSize;
+
+	// only records present in both files are complete
+	size_t entrySize = sizeof(int64_t)*(1+formats.size());
+	records = (indexSize-indexHeaderSize)/entrySize;
+	while (records>0 && (uint64_t)entry(records-1)[0]+recordSize>dataSize) records--;
+	madvise(data, dataSize, MADV_SEQUENTIAL);
+
+	LOG(2, "Opened '" << file << "' with " << formats.size() << " node(s) and " << records << " record(s)");
+	return true;
+}
+
+
+
+void RawReader::close()
+{
+	if (data) munmap(data, dataSize);
+	if (index) munmap(index, indexSize);
+	data = nullptr;
+	index = nullptr;
+	dataSize = 0;
+	indexSize = 0;
+	formats.clear();
+	records = 0;
+}
+
+
+
+cv::Mat RawReader::frame(uint64_t record, int nodeID) const
+{
+	if (record>=records || nodeID<0 || nodeID>=nodes()) return cv::Mat();
+	const RawNodeFormat& format = formats.at(nodeID);
+	return cv::Mat(format.rows, format.cols, format.type, data + entry(record)[0] + format.offset, format.step);
+}
+
+
+
+int64_t RawReader::stamp(uint64_t record, int nodeID) const
+{
+	if (record>=records || nodeID<0 || nodeID>=nodes()) return 0;
+	return entry(record)[1+nodeID];
+}
+
+
+
+void RawReader::prefetch(uint64_t record) const
+{
+	if (record>=records) return;
+	// madvise needs a page aligned address, records are 4 KiB aligned
+	madvise(data + entry(record)[0], recordSize, MADV_WILLNEED);
+}
+
+
+
+const int64_t* RawReader::entry(uint64_t record) const
+{
+	return reinterpret_cast<const int64_t*>(index + indexHeaderSize + record*sizeof(int64_t)*(1+formats.size()));
+}
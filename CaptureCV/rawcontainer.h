@@ -0,0 +1,154 @@
+#ifndef RAW_CONTAINER_H
+#define RAW_CONTAINER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bvs/logger.h"
+#include "opencv2/core.hpp"
+
+
+
+/** Layout of one node's frames in a raw container. */
+struct RawNodeFormat
+{
+	int32_t rows; /**< Image rows. */
+	int32_t cols; /**< Image columns. */
+	int32_t type; /**< OpenCV image type. */
+	int32_t reserved; /**< Unused, zero. */
+	uint64_t step; /**< Bytes per image row. */
+	uint64_t offset; /**< Offset of the image inside a record. */
+};
+
+
+
+/** Writes frames of all nodes into one append-only raw container.
+ * The container consists of a data file and an index file (data file name
+ * plus '.idx'). The data file starts with a 4 KiB header describing each
+ * node's frame format, followed by one fixed size record per step holding
+ * the raw images of all nodes, each image starting on a 4 KiB boundary. The
+ * file grows in large preallocated chunks and each record is written with a
+ * single vectored write. The index file holds one entry per record (data
+ * file offset and per node capture time) and is appended with each record,
+ * so a recording stays readable up to its last complete record.
+ */
+class RawWriter
+{
+	public:
+		/** Constructor.
+		 * @param[in] preallocate Bytes to preallocate whenever the file is full.
+		 */
+		RawWriter(uint64_t preallocate);
+
+		/** Destructor, closes the container. */
+		~RawWriter();
+
+		/** Create a container, truncates existing files.
+		 * @param[in] file Data file name.
+		 * @param[in] numNodes Number of nodes.
+		 * @return True on success.
+		 */
+		bool open(const std::string& file, int numNodes);
+
+		/** Append a record, the first one defines the frame formats.
+		 * @param[in] images Image per node, must match the first record's formats.
+		 * @param[in] stamps Capture time per node.
+		 * @return True on success.
+		 */
+		bool write(const std::vector<cv::Mat>& images, const std::vector<int64_t>& stamps);
+
+		/** Truncate the preallocated space and close the container. */
+		void close();
+
+		/** Number of written records. */
+		uint64_t size() const { return records; }
+
+	private:
+		BVS::Logger logger; /**< Logger. */
+		uint64_t preallocate; /**< Preallocation chunk size. */
+		std::string file; /**< Data file name. */
+		int dataFD; /**< Data file descriptor. */
+		int indexFD; /**< Index file descriptor. */
+		std::vector<RawNodeFormat> formats; /**< Frame format per node. */
+		uint64_t recordSize; /**< Bytes per record. */
+		uint64_t records; /**< Number of written records. */
+		uint64_t allocated; /**< Allocated data file size. */
+		std::vector<char> entry; /**< Index entry buffer. */
+
+		RawWriter(const RawWriter&) = delete; /**< -Weffc++ */
+		RawWriter& operator=(const RawWriter&) = delete; /**< -Weffc++ */
+};
+
+
+
+/** Memory maps a raw container for random access replay.
+ * Frames are returned as cv::Mat views into the (private, copy on write)
+ * mapping, so reading a record copies no image data and seeking is O(1).
+ */
+class RawReader
+{
+	public:
+		/** Constructor. */
+		RawReader();
+
+		/** Destructor, unmaps the container. */
+		~RawReader();
+
+		/** Map a container written by RawWriter.
+		 * @param[in] file Data file name.
+		 * @return True on success.
+		 */
+		bool open(const std::string& file);
+
+		/** Unmap the container. */
+		void close();
+
+		/** Number of nodes. */
+		int nodes() const { return formats.size(); }
+
+		/** Number of complete records. */
+		uint64_t size() const { return records; }
+
+		/** Get a node's frame of a record without copying.
+		 * @param[in] record Record number.
+		 * @param[in] nodeID Node id.
+		 * @return View into the mapping, valid until close().
+		 */
+		cv::Mat frame(uint64_t record, int nodeID) const;
+
+		/** Get a node's capture time of a record.
+		 * @param[in] record Record number.
+		 * @param[in] nodeID Node id.
+		 * @return Capture time in microseconds.
+		 */
+		int64_t stamp(uint64_t record, int nodeID) const;
+
+		/** Ask the kernel to read a record ahead.
+		 * @param[in] record Record number.
+		 */
+		void prefetch(uint64_t record) const;
+
+	private:
+		BVS::Logger logger; /**< Logger. */
+		char* data; /**< Data file mapping. */
+		size_t dataSize; /**< Data file mapping size. */
+		char* index; /**< Index file mapping. */
+		size_t indexSize; /**< Index file mapping size. */
+		std::vector<RawNodeFormat> formats; /**< Frame format per node. */
+		uint64_t recordSize; /**< Bytes per record. */
+		uint64_t records; /**< Number of complete records. */
+
+		/** Get a record's index entry.
+		 * @param[in] record Record number.
+		 * @return Entry, data file offset followed by the per node capture times.
+		 */
+		const int64_t* entry(uint64_t record) const;
+
+		RawReader(const RawReader&) = delete; /**< -Weffc++ */
+		RawReader& operator=(const RawReader&) = delete; /**< -Weffc++ */
+};
+
+
+
+#endif //RAW_CONTAINER_H
@@ -1,6 +1,6 @@
 #include "ExampleCV.h"
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/highgui/highgui.hpp>
+#include "preview.h"
 
 
 
@@ -25,11 +25,8 @@ ExampleCV::ExampleCV(BVS::ModuleInfo info, const BVS::Info& bvs)
 	// CONFIGURATION RETRIEVAL
 	//yourSwitch(bvs.config.getValue<bool>(info.conf + ".yourSwitch", false)),
 {
-	if (showResult)
-	{
-		cv::namedWindow("result");
-		cv::startWindowThread();
-	}
+	// windows are handled by the shared preview, see Readme.md
+	if (showResult) Preview::instance().configure(bvs);
 }
 
 
@@ -37,7 +34,7 @@ ExampleCV::ExampleCV(BVS::ModuleInfo info, const BVS::Info& bvs)
 // This is your module's destructor.
 ExampleCV::~ExampleCV()
 {
-
+	if (showResult) Preview::instance().close("result");
 }
 
 
@@ -65,12 +62,14 @@ BVS::Status ExampleCV::execute()
 	// send to other modules
 	output.send(tmpImg);
 
-	// show image using opencv
+	// hand the image to the preview, drawing is done by its GUI thread
 	if (showResult)
 	{
-		cv::putText(img, bvs.getFPS(), cv::Point(10, 30), CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(255, 255, 255), 2);
-		cv::imshow("result", img);
-		cv::waitKey(1);
+		std::string fps = bvs.getFPS();
+		Preview::instance().show("result", img, [fps](const cv::Mat& image, cv::Mat& shown) {
+			image.copyTo(shown);
+			cv::putText(shown, fps, cv::Point(10, 30), CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(255, 255, 255), 2);
+		});
 	}
 
 	return BVS::Status::OK;
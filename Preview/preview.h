@@ -0,0 +1,274 @@
+#ifndef BVS_PREVIEW_H
+#define BVS_PREVIEW_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "bvs/module.h"
+#include "opencv2/core.hpp"
+#include "opencv2/highgui.hpp"
+
+
+
+/** Shared preview windows for debug display.
+ * Modules hand frames to the preview instead of calling cv::imshow() and
+ * cv::waitKey() from execute(). show() only copies the frame into a reused
+ * buffer and replaces the window's pending frame (latest frame wins), it
+ * never waits for the GUI. One GUI thread per process creates the windows,
+ * renders pending frames at a capped rate and polls the keyboard, so
+ * highgui is only ever used from that thread and cv::startWindowThread() is
+ * not needed.
+ *
+ * There is one instance per process: the instance is a function local
+ * static of an inline function, which GCC exports as a unique symbol, so all
+ * modules share it (this also keeps the module libraries from being unloaded
+ * while the GUI thread runs).
+ *
+ * Configuration (read by the modules using the preview):
+ * - Preview.enabled = <ON> | OFF, OFF disables all preview windows.
+ * - Preview.maxFPS = <30>, frames per second rendered per window.
+ */
+class Preview
+{
+	public:
+		/** Optional conversion of a frame before it is shown, runs in the GUI thread.
+		 * @param[in] image Frame handed to show().
+		 * @param[out] shown Image to show.
+		 */
+		using Prepare = std::function<void(const cv::Mat& image, cv::Mat& shown)>;
+
+		/** Get the process wide preview. */
+		static Preview& instance()
+		{
+			static Preview preview;
+			return preview;
+		}
+
+		/** Preview destructor, stops the GUI thread and closes all windows. */
+		~Preview()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				exit = true;
+			}
+			signal.notify_one();
+			if (thread.joinable()) thread.join();
+		}
+
+		/** Apply the configuration, see the class documentation.
+		 * @param[in] enabled Show frames at all.
+		 * @param[in] maxFPS Maximum frames per second per window, 0 for no limit.
+		 */
+		void configure(bool enabled, double maxFPS)
+		{
+			interval = maxFPS>0 ? static_cast<int64_t>(1000000/maxFPS) : 0;
+			setEnabled(enabled);
+		}
+
+		/** Apply the Preview section of the configuration, see the class documentation.
+		 * @param[in] bvs BVS info holding the configuration.
+		 */
+		void configure(const BVS::Info& bvs)
+		{
+			configure(bvs.config.getValue<bool>("Preview.enabled", true), bvs.config.getValue<double>("Preview.maxFPS", 30.0));
+		}
+
+		/** Enable or disable the preview at runtime, disabling closes all windows.
+		 * @param[in] enabled Show frames.
+		 */
+		void setEnabled(bool enabled)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			this->enabled = enabled;
+			if (!enabled) for (auto& it: windows) it.second.fresh = false;
+			signal.notify_one();
+		}
+
+		/** Whether frames are shown. */
+		bool isEnabled() const { return enabled; }
+
+		/** Hand a frame to a window, creates the window if needed.
+		 * Frames arriving faster than the rate limit are dropped before copying.
+		 * @param[in] window Window name.
+		 * @param[in] image Frame, copied.
+		 * @param[in] prepare Optional conversion done by the GUI thread.
+		 * @return False if the frame was dropped.
+		 */
+		bool show(const std::string& window, const cv::Mat& image, Prepare prepare = nullptr)
+		{
+			if (!enabled || image.empty()) return false;
+
+			cv::Mat buffer;
+			auto now = std::chrono::steady_clock::now();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				Window& w = windows[window];
+				if (now<w.accepted+std::chrono::microseconds(interval)) return false;
+				w.accepted = now;
+				w.closing = false;
+				cv::swap(buffer, w.spare);
+				if (!thread.joinable()) thread = std::thread(&Preview::run, this);
+			}
+
+			// the buffer is owned by this call only, so copy without holding the lock
+			image.copyTo(buffer);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				Window& w = windows[window];
+				cv::swap(buffer, w.pending);
+				cv::swap(buffer, w.spare);
+				w.prepare = std::move(prepare);
+				w.fresh = true;
+			}
+			signal.notify_one();
+			return true;
+		}
+
+		/** Close a window, e.g. in a module's destructor.
+		 * @param[in] window Window name.
+		 */
+		void close(const std::string& window)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = windows.find(window);
+			if (it==windows.end()) return;
+			it->second.fresh = false;
+			it->second.closing = true;
+			signal.notify_one();
+		}
+
+		/** Get the last key pressed in any preview window, reported once per window.
+		 * @param[in] window Window name of the caller.
+		 * @return Key code or -1 if no key was pressed since the last call.
+		 */
+		int key(const std::string& window)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = windows.find(window);
+			if (it==windows.end() || it->second.keySeq==keySeq) return -1;
+			it->second.keySeq = keySeq;
+			return lastKey;
+		}
+
+	private:
+		/** Preview window state, buffers rotate between show() and the GUI thread. */
+		struct Window
+		{
+			Window() : pending(), spare(), shown(), prepare(), accepted(), fresh(false), open(false), closing(false), keySeq(0) { }
+
+			cv::Mat pending; /**< Latest frame not yet shown. */
+			cv::Mat spare; /**< Buffer reused by the next show(). */
+			cv::Mat shown; /**< Frame being shown (GUI thread). */
+			Prepare prepare; /**< Conversion of the pending frame. */
+			std::chrono::steady_clock::time_point accepted; /**< Time of the last accepted frame. */
+			bool fresh; /**< Pending holds an unshown frame. */
+			bool open; /**< Window was created (GUI thread). */
+			bool closing; /**< Window is to be destroyed. */
+			uint64_t keySeq; /**< Last key reported to this window's owner. */
+		};
+
+		std::map<std::string, Window> windows; /**< Windows by name. */
+		std::atomic<bool> enabled; /**< Show frames. */
+		std::atomic<int64_t> interval; /**< Minimum time between frames per window in microseconds. */
+		int lastKey; /**< Last key pressed. */
+		uint64_t keySeq; /**< Number of keys pressed. */
+		bool exit; /**< Stop the GUI thread. */
+		std::mutex mutex; /**< Protects the windows and keys. */
+		std::condition_variable signal; /**< Signals new frames, state changes or exit. */
+		std::thread thread; /**< GUI thread, started with the first frame. */
+
+		/** Preview constructor. */
+		Preview()
+			: windows()
+			, enabled(true)
+			, interval(1000000/30)
+			, lastKey(-1)
+			, keySeq(0)
+			, exit(false)
+			, mutex()
+			, signal()
+			, thread()
+		{ }
+
+		/** GUI thread, the only one using highgui. */
+		void run()
+		{
+			BVS::nameThisThread("preview");
+
+			struct Draw { std::string name; cv::Mat image; Prepare prepare; };
+			std::vector<Draw> draws;
+			std::vector<std::string> destroy;
+			cv::Mat canvas;
+			bool anyOpen = false;
+
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!exit) {
+				// keep polling the keyboard and window events while windows are open
+				auto pending = [&](){
+					if (exit) return true;
+					for (auto& it: windows) if (it.second.fresh || (it.second.closing && it.second.open) || (!enabled && it.second.open)) return true;
+					return false;
+				};
+				if (anyOpen) signal.wait_for(lock, std::chrono::milliseconds(10), pending);
+				else signal.wait(lock, pending);
+				if (exit) break;
+
+				for (auto it=windows.begin(); it!=windows.end(); ) {
+					Window& w = it->second;
+					if (w.closing || !enabled) {
+						if (w.open) destroy.push_back(it->first);
+						w.open = false;
+						w.fresh = false;
+						w.shown.release();
+						if (w.closing) { it = windows.erase(it); continue; }
+					} else if (w.fresh) {
+						cv::swap(w.pending, w.shown);
+						draws.push_back(Draw{it->first, w.shown, w.prepare});
+						w.fresh = false;
+						w.open = true;
+					}
+					++it;
+				}
+				anyOpen = false;
+				for (auto& it: windows) anyOpen |= it.second.open;
+				lock.unlock();
+
+				for (auto& name: destroy) cv::destroyWindow(name);
+				for (auto& draw: draws) {
+					cv::namedWindow(draw.name, cv::WINDOW_NORMAL);
+					if (draw.prepare) {
+						draw.prepare(draw.image, canvas);
+						cv::imshow(draw.name, canvas);
+					}
+					else cv::imshow(draw.name, draw.image);
+				}
+				destroy.clear();
+				draws.clear();
+				int key = anyOpen ? cv::waitKey(1) : -1;
+
+				lock.lock();
+				if (key>=0) {
+					lastKey = key & 0xff;
+					keySeq++;
+				}
+			}
+			lock.unlock();
+
+			cv::destroyAllWindows();
+		}
+
+		Preview(const Preview&) = delete; /**< -Weffc++ */
+		Preview& operator=(const Preview&) = delete; /**< -Weffc++ */
+};
+
+
+
+#endif //BVS_PREVIEW_H
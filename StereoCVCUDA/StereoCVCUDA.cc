@@ -1,4 +1,11 @@
 #include "StereoCVCUDA.h"
+#include "preview.h"
+#include <algorithm>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 
 
@@ -16,34 +23,95 @@ StereoCVCUDA::StereoCVCUDA(BVS::ModuleInfo info, const BVS::Info& bvs)
 	input0("input0", BVS::ConnectorType::INPUT),
 	input1("input1", BVS::ConnectorType::INPUT),
 	depthImage("depthImage", BVS::ConnectorType::OUTPUT),
+	colorImage("colorImage", BVS::ConnectorType::OUTPUT),
 	in0(),
 	in1(),
 	grey0(),
 	grey1(),
+	depth(),
+	useGPU(bvs.config.getValue<std::string>(info.conf+".backend", "gpu")=="gpu"),
+	switchInputs(bvs.config.getValue<bool>(info.conf+".switchInputs", false)),
+	stereoAlgo(0),
+#ifdef STEREOCVCUDA_GPU
 	gpuMat0(),
 	gpuMat1(),
 	disparity(),
-	switchInputs(false),
-	stereoAlgo(0),
 	bmGPU(),
 	bpGPU(),
 	csGPU(),
-	estimate(true)
+	estimate(bvs.config.getValue<bool>(info.conf+".estimateParams", true)),
+	raw(),
+#endif
+	cpuThreads(bvs.config.getValue<int>(info.conf+".cpuThreads", 0)),
+	ndispCPU(bvs.config.getValue<int>(info.conf+".cpuNumDisparities", 64)),
+	winSizeCPU(bvs.config.getValue<int>(info.conf+".cpuBlockSize", 15)),
+	bmCPU(),
+	sgbmCPU(),
+	dispCPU(),
+	showDisparity(bvs.config.getValue<bool>(info.conf+".showDisparity", false)),
+	vizExit(false),
+	vizPending(false),
+	vizRange(0),
+	vizDepth(),
+	vizColor(),
+	colorMap(1, 256, CV_8UC3),
+	vizFPS(),
+	vizMutex(),
+	vizSignal(),
+	vizThread()
 {
-	bmGPU.preset = 0;
-	bmGPU.ndisp = 64;
-	bmGPU.winSize = 19;
-	bmGPU.avergeTexThreshold = 2;
-
-	bpGPU.ndisp = 64;
-	bpGPU.iters = 5;
-	bpGPU.levels = 5;
+#ifdef STEREOCVCUDA_GPU
+	if (useGPU && cv::gpu::getCudaEnabledDeviceCount()==0)
+	{
+		LOG(1, "No CUDA device found, using CPU backend!");
+		useGPU = false;
+	}
+
+	bmGPU.preset = bvs.config.getValue<int>(info.conf+".bmPrefilter", 0);
+	bmGPU.ndisp = bvs.config.getValue<int>(info.conf+".bmNumDisparities", 64);
+	bmGPU.winSize = bvs.config.getValue<int>(info.conf+".bmWinSize", 19);
+	bmGPU.avergeTexThreshold = bvs.config.getValue<float>(info.conf+".bmTextureThreshold", 2);
+
+	bpGPU.ndisp = bvs.config.getValue<int>(info.conf+".bpNumDisparities", 64);
+	bpGPU.iters = bvs.config.getValue<int>(info.conf+".bpIterations", 5);
+	bpGPU.levels = bvs.config.getValue<int>(info.conf+".bpLevels", 5);
 	bpGPU.msg_type = CV_32F;
 
-	csGPU.ndisp = 128;
-	csGPU.iters = 8;
-	csGPU.levels = 4;
-	csGPU.nr_plane = 4;
+	csGPU.ndisp = bvs.config.getValue<int>(info.conf+".csNumDisparities", 128);
+	csGPU.iters = bvs.config.getValue<int>(info.conf+".csIterations", 8);
+	csGPU.levels = bvs.config.getValue<int>(info.conf+".csLevels", 4);
+	csGPU.nr_plane = bvs.config.getValue<int>(info.conf+".csPlanes", 4);
+#else
+	if (useGPU) LOG(1, "Built without CUDA, using CPU backend!");
+	useGPU = false;
+#endif
+
+	if (!useGPU)
+	{
+		// both matchers parallelize internally via cv::parallel_for_
+		if (cpuThreads>0) cv::setNumThreads(cpuThreads);
+#if CV_MAJOR_VERSION>=3
+		bmCPU = cv::StereoBM::create();
+		sgbmCPU = cv::StereoSGBM::create();
+		sgbmCPU->setMode(cv::StereoSGBM::MODE_SGBM_3WAY);
+#endif
+		configureCPU();
+	}
+
+	std::string algorithm = bvs.config.getValue<std::string>(info.conf+".algorithm", "BM");
+	if (useGPU) stereoAlgo = algorithm=="BP" ? 1 : algorithm=="CSBP" ? 2 : 0;
+	else stereoAlgo = algorithm=="SGBM" ? 1 : 0;
+
+	// jet like color map, blue (far) to red (near)
+	for (int i=0; i<256; i++)
+	{
+		float x = i/255.0f;
+		auto ramp = [x](float c){ return cv::saturate_cast<uchar>(255*std::min(std::max(1.5f-std::abs(4*x-c), 0.0f), 1.0f)); };
+		colorMap.at<cv::Vec3b>(0, i) = cv::Vec3b(ramp(1), ramp(2), ramp(3));
+	}
+
+	if (showDisparity) Preview::instance().configure(bvs);
+	vizThread = std::thread(&StereoCVCUDA::visualize, this);
 }
 
 
@@ -52,7 +120,13 @@ StereoCVCUDA::StereoCVCUDA(BVS::ModuleInfo info, const BVS::Info& bvs)
 // See the constructor for more info.
 StereoCVCUDA::~StereoCVCUDA()
 {
-
+	{
+		std::lock_guard<std::mutex> lock(vizMutex);
+		vizExit = true;
+	}
+	vizSignal.notify_one();
+	if (vizThread.joinable()) vizThread.join();
+	if (showDisparity) Preview::instance().close("disparity");
 }
 
 
@@ -60,6 +134,10 @@ StereoCVCUDA::~StereoCVCUDA()
 // Put all your work here.
 BVS::Status StereoCVCUDA::execute()
 {
+	// keys are handled here to avoid racing with the matchers
+	int key = showDisparity ? Preview::instance().key("disparity") : -1;
+	if (key>=0) handleInput(key);
+
 	if (switchInputs)
 	{
 		if (!input0.receive(in1) || !input1.receive(in0)) return BVS::Status::NOINPUT;
@@ -76,13 +154,130 @@ BVS::Status StereoCVCUDA::execute()
 		//TODO test cv::gpu::cvtColor...
 		cv::cvtColor(in0, grey0, CV_RGB2GRAY);
 		cv::cvtColor(in1, grey1, CV_RGB2GRAY);
+		in0 = grey0;
+		in1 = grey1;
 	}
-	in0 = grey0;
-	in1 = grey1;
 
 	cv::pyrDown(in0, grey0);
 	cv::pyrDown(in1, grey1);
 
+#ifdef STEREOCVCUDA_GPU
+	if (useGPU) computeGPU(depth);
+	else computeCPU(depth);
+#else
+	computeCPU(depth);
+#endif
+	if (depthImage.active()) depthImage.send(depth);
+
+	// visualization is done by a low priority thread, the result is sent one
+	// frame late, but keeps drawing, copying and the GUI out of this thread
+	if (showDisparity || colorImage.active())
+	{
+		std::lock_guard<std::mutex> lock(vizMutex);
+		depth.copyTo(vizDepth);
+		vizRange = currentRange();
+		vizFPS = bvs.getFPS();
+		vizPending = true;
+		if (colorImage.active() && !vizColor.empty()) colorImage.send(vizColor.clone());
+		vizSignal.notify_one();
+	}
+
+	return BVS::Status::OK;
+}
+
+
+
+void StereoCVCUDA::computeCPU(cv::Mat& out)
+{
+	switch (stereoAlgo)
+	{
+#if CV_MAJOR_VERSION>=3
+		case 0: bmCPU->compute(grey0, grey1, dispCPU); break;
+		case 1: sgbmCPU->compute(grey0, grey1, dispCPU); break;
+#else
+		case 0: bmCPU(grey0, grey1, dispCPU, CV_16S); break;
+		case 1: sgbmCPU(grey0, grey1, dispCPU); break;
+#endif
+	}
+
+	// fixed point with 4 fractional bits, invalid pixels become -1
+	dispCPU.convertTo(out, CV_32F, 1./16.);
+}
+
+
+
+void StereoCVCUDA::configureCPU()
+{
+#if CV_MAJOR_VERSION>=3
+	bmCPU->setNumDisparities(ndispCPU);
+	bmCPU->setBlockSize(winSizeCPU);
+	sgbmCPU->setNumDisparities(ndispCPU);
+	sgbmCPU->setBlockSize(winSizeCPU);
+	sgbmCPU->setP1(8*winSizeCPU*winSizeCPU);
+	sgbmCPU->setP2(32*winSizeCPU*winSizeCPU);
+#else
+	// OpenCV 2.x (CUDA builds), same settings through the old interface
+	bmCPU.init(cv::StereoBM::BASIC_PRESET, ndispCPU, winSizeCPU);
+	sgbmCPU.numberOfDisparities = ndispCPU;
+	sgbmCPU.SADWindowSize = winSizeCPU;
+	sgbmCPU.P1 = 8*winSizeCPU*winSizeCPU;
+	sgbmCPU.P2 = 32*winSizeCPU*winSizeCPU;
+#endif
+}
+
+
+
+void StereoCVCUDA::visualize()
+{
+	BVS::nameThisThread("cvcudaViz");
+#ifdef __linux__
+	// lowest priority for this thread only
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+	cv::Mat depth, grey, color;
+	std::unique_lock<std::mutex> lock(vizMutex);
+	while (true)
+	{
+		vizSignal.wait(lock, [&](){ return vizExit || vizPending; });
+		if (vizExit) break;
+
+		cv::swap(depth, vizDepth);
+		float range = vizRange;
+		std::string fps = vizFPS;
+		vizPending = false;
+		lock.unlock();
+
+		depth.convertTo(grey, CV_8U, 255.0/std::max(range, 1.0f));
+		cv::cvtColor(grey, color, CV_GRAY2BGR);
+		cv::LUT(color, colorMap, color);
+		color.setTo(cv::Scalar(0, 0, 0), depth<0);
+		if (showDisparity)
+		{
+			cv::putText(color, fps, cv::Point(10, 30),
+					CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(255, 255, 255), 2);
+			Preview::instance().show("disparity", color);
+		}
+
+		lock.lock();
+		cv::swap(color, vizColor);
+	}
+}
+
+
+
+int StereoCVCUDA::currentRange() const
+{
+#ifdef STEREOCVCUDA_GPU
+	if (useGPU) return stereoAlgo==0 ? bmGPU.ndisp : stereoAlgo==1 ? bpGPU.ndisp : csGPU.ndisp;
+#endif
+	return ndispCPU;
+}
+
+
+
+#ifdef STEREOCVCUDA_GPU
+void StereoCVCUDA::computeGPU(cv::Mat& out)
+{
 	gpuMat0.upload(grey0);
 	gpuMat1.upload(grey1);
 
@@ -100,42 +295,59 @@ BVS::Status StereoCVCUDA::execute()
 		case 2: csGPU(gpuMat0, gpuMat1, disparity); break;
 	}
 
-	cv::Mat grey;
-	disparity.download(grey);
-	//TODO needed? grey.convertTo(grey, CV_8U, 1./16.);
-
-	cv::Mat out;
-	cv::gpu::GpuMat color;
-	switch (stereoAlgo)
-	{
-		case 0: cv::gpu::drawColorDisp(disparity, color, bmGPU.ndisp); break;
-		case 1: cv::gpu::drawColorDisp(disparity, color, bpGPU.ndisp); break;
-		case 2: cv::gpu::drawColorDisp(disparity, color, csGPU.ndisp); break;
-	}
-	color.download(out);
-	cv::putText(out, bvs.getFPS(), cv::Point(10, 30),
-			CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(0, 0, 255), 2);
-
-	//cv::Mat edges;
-	//cv::gpu::GpuMat canny;
-	//cv::gpu::GaussianBlur(disparity, canny, cv::Size(31,31), 0);
-	//cv::gpu::Canny(canny, disparity, 1.0, 2.0);
-	//disparity.download(edges);
-
-	cv::imshow("grey", grey);
-	cv::imshow("out", out);
-	//cv::imshow("0", grey0);
-	//cv::imshow("1", grey1);
-	//cv::imshow("edges", edges);
-
-	handleInput(cv::waitKey(1));
-	return BVS::Status::OK;
+	disparity.download(raw);
+	raw.convertTo(out, CV_32F);
 }
+#endif
 
 
 
 void StereoCVCUDA::handleInput(char c)
 {
+	if (!useGPU)
+	{
+		switch (c)
+		{
+			case 'h':
+				LOG(1, "\n\
+usage (CPU):\n\
+    x   - switch inputs: " << switchInputs << "\n\
+    a   - change algorithm: " << (stereoAlgo==0? "BM": "SGBM") << "\n\
+    n/N - change number of disparities: " << ndispCPU << "\n\
+    w/W - change block size: " << winSizeCPU << "\n\
+"); break;
+
+			case 'x': switchInputs = !switchInputs; break;
+			case 'a':
+				stereoAlgo = (stereoAlgo + 1) % 2;
+				LOG(1, "algo: " << (stereoAlgo==0? "BM": "SGBM"));
+				break;
+			case 'N':
+				ndispCPU += 16;
+				configureCPU();
+				LOG(1, "ndisp: " << ndispCPU);
+				break;
+			case 'n':
+				ndispCPU = ndispCPU-16 < 16 ? 16: ndispCPU-16;
+				configureCPU();
+				LOG(1, "ndisp: " << ndispCPU);
+				break;
+			case 'W':
+				winSizeCPU += 2;
+				configureCPU();
+				LOG(1, "winSize: " << winSizeCPU);
+				break;
+			case 'w':
+				winSizeCPU = winSizeCPU-2 < 5 ? 5: winSizeCPU-2;
+				configureCPU();
+				LOG(1, "winSize: " << winSizeCPU);
+				break;
+			case 27: exit (0); break;
+		}
+		return;
+	}
+
+#ifdef STEREOCVCUDA_GPU
 	switch (c)
 	{
 		case 'h':
@@ -233,6 +445,7 @@ CS:\n\
 			break;
 		case 27: exit (0); break;
 	}
+#endif
 }
 
 
@@ -3,7 +3,12 @@
 
 #include "bvs/module.h"
 #include "opencv2/opencv.hpp"
+#ifdef STEREOCVCUDA_GPU
 #include "opencv2/gpu/gpu.hpp"
+#endif
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 
 
@@ -37,6 +42,9 @@ class StereoCVCUDA : public BVS::Module
 		 */
 		BVS::Status execute();
 
+		/** Handle a keypress of the display window, press 'h' for help.
+		 * @param[in] c Pressed key.
+		 */
 		void handleInput(char c);
 
 		/** UNUSED
@@ -67,24 +75,81 @@ class StereoCVCUDA : public BVS::Module
 		 */
 		BVS::Connector<cv::Mat> input0;
 		BVS::Connector<cv::Mat> input1;
-		BVS::Connector<cv::Mat> depthImage;
+		BVS::Connector<cv::Mat> depthImage; /**< Disparity (CV_32FC1, pixels of the half size input, <0 invalid). */
+		BVS::Connector<cv::Mat> colorImage; /**< Color coded disparity (CV_8UC3), only produced if connected. */
 
 		cv::Mat in0;
 		cv::Mat in1;
 		cv::Mat grey0;
 		cv::Mat grey1;
+		cv::Mat depth; /**< Disparity to send. */
+
+		bool useGPU; /**< Run on the CUDA backend (only if built with it). */
+		bool switchInputs;
+		int stereoAlgo;
 
+#ifdef STEREOCVCUDA_GPU
 		cv::gpu::GpuMat gpuMat0;
 		cv::gpu::GpuMat gpuMat1;
 		cv::gpu::GpuMat disparity;
 
-		bool switchInputs;
-		int stereoAlgo;
 		cv::gpu::StereoBM_GPU bmGPU;
 		cv::gpu::StereoBeliefPropagation bpGPU;
 		cv::gpu::StereoConstantSpaceBP csGPU;
 
 		bool estimate;
+		cv::Mat raw; /**< Downloaded disparity. */
+#endif
+
+		int cpuThreads; /**< Threads used by OpenCV on the CPU backend, 0 = default. */
+		int ndispCPU; /**< Number of disparities of the CPU matchers (multiple of 16). */
+		int winSizeCPU; /**< Block size of the CPU matchers (odd). */
+#if CV_MAJOR_VERSION>=3
+		cv::Ptr<cv::StereoBM> bmCPU; /**< CPU block matcher. */
+		cv::Ptr<cv::StereoSGBM> sgbmCPU; /**< CPU semi-global block matcher. */
+#else
+		cv::StereoBM bmCPU; /**< CPU block matcher. */
+		cv::StereoSGBM sgbmCPU; /**< CPU semi-global block matcher. */
+#endif
+		cv::Mat dispCPU; /**< Fixed point (x16) disparity of the CPU matchers. */
+
+		bool showDisparity; /**< Show the color coded disparity in a window. */
+		bool vizExit; /**< Stop the visualization thread. */
+		bool vizPending; /**< vizDepth holds a frame not yet visualized. */
+		float vizRange; /**< Disparity range (current number of disparities) of vizDepth. */
+		cv::Mat vizDepth; /**< Latest disparity handed to the visualization thread. */
+		cv::Mat vizColor; /**< Latest color coded disparity. */
+		cv::Mat colorMap; /**< 256 entry color lookup table. */
+		std::string vizFPS; /**< Frame rate shown in the window. */
+		std::mutex vizMutex; /**< Protects the viz* members. */
+		std::condition_variable vizSignal; /**< Signals a new frame or exit. */
+		std::thread vizThread; /**< Low priority visualization thread. */
+
+		/** Visualization thread.
+		 * Colorizes the latest disparity (older ones are skipped) and hands it
+		 * to the preview if requested.
+		 */
+		void visualize();
+
+		/** Disparity range of the current algorithm, used for colorization.
+		 * @return Number of disparities.
+		 */
+		int currentRange() const;
+
+		/** Compute the disparity with the CPU backend.
+		 * @param[out] out Disparity as CV_32FC1 in pixels.
+		 */
+		void computeCPU(cv::Mat& out);
+
+		/** Apply ndispCPU/winSizeCPU to the CPU matchers. */
+		void configureCPU();
+
+#ifdef STEREOCVCUDA_GPU
+		/** Compute the disparity with the CUDA backend.
+		 * @param[out] out Disparity as CV_32FC1 in pixels.
+		 */
+		void computeGPU(cv::Mat& out);
+#endif
 
 		StereoCVCUDA(const StereoCVCUDA&) = delete; /**< -Weffc++ */
 		StereoCVCUDA& operator=(const StereoCVCUDA&) = delete; /**< -Weffc++ */
@@ -1,4 +1,11 @@
 #include "StereoELAS.h"
+#include "preview.h"
+#include "filter.h"
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <functional>
 
 
 
@@ -11,6 +18,10 @@ StereoELAS::StereoELAS(BVS::ModuleInfo info, const BVS::Info& bvs)
 	inR("inR", BVS::ConnectorType::INPUT),
 	outL("outL", BVS::ConnectorType::OUTPUT),
 	outR("outR", BVS::ConnectorType::OUTPUT),
+	outSupport("outSupport", BVS::ConnectorType::OUTPUT),
+	outTriangles("outTriangles", BVS::ConnectorType::OUTPUT),
+	outQuality("outQuality", BVS::ConnectorType::OUTPUT),
+	outMask("outMask", BVS::ConnectorType::OUTPUT),
 	discardTopLines(bvs.config.getValue<int>(info.conf+".discardTopLines", 0)),
 	discardBottomLines(bvs.config.getValue<int>(info.conf+".discardBottomLines", 0)),
 	scalingFactor(bvs.config.getValue<float>(info.conf+".scalingFactor", 1)),
@@ -18,6 +29,55 @@ StereoELAS::StereoELAS(BVS::ModuleInfo info, const BVS::Info& bvs)
 	sliceOverlap(bvs.config.getValue<int>(info.conf+".sliceOverlap", 10)),
 	showDisparities(bvs.config.getValue<bool>(info.conf+".showDisparities", false)),
 	sliceExit(false),
+	sparseOnly(bvs.config.getValue<bool>(info.conf+".sparseOnly", false)),
+	sparseRasterize(bvs.config.getValue<bool>(info.conf+".sparseRasterize", true)),
+	upsampleSigma(bvs.config.getValue<float>(info.conf+".upsampleSigma", 10)),
+	bandHeight(bvs.config.getValue<int>(info.conf+".bandHeight", 0)),
+	rowPriors(bvs.config.getValue<bool>(info.conf+".rowPriors", false)),
+	rowPriorMargin(bvs.config.getValue<int>(info.conf+".rowPriorMargin", 8)),
+	rowPriorQuantile(bvs.config.getValue<float>(info.conf+".rowPriorQuantile", 0.02f)),
+	rowPriorMinValid(bvs.config.getValue<float>(info.conf+".rowPriorMinValid", 0.1f)),
+	rowPriorMaxSaturation(bvs.config.getValue<float>(info.conf+".rowPriorMaxSaturation", 0.05f)),
+	rowBoundsValid(false),
+	rowMin(),
+	rowMax(),
+	trackRange(bvs.config.getValue<bool>(info.conf+".trackRange", false)),
+	rangeMargin(bvs.config.getValue<int>(info.conf+".rangeMargin", 8)),
+	rangeQuantile(bvs.config.getValue<float>(info.conf+".rangeQuantile", 0.01f)),
+	rangeHistory(bvs.config.getValue<int>(info.conf+".rangeHistory", 5)),
+	rangeHysteresis(bvs.config.getValue<int>(info.conf+".rangeHysteresis", 4)),
+	rangeMaxSaturation(bvs.config.getValue<float>(info.conf+".rangeMaxSaturation", 0.02f)),
+	rangeSceneCut(bvs.config.getValue<float>(info.conf+".rangeSceneCut", 0.5f)),
+	fullDispMin(0),
+	fullDispMax(0),
+	lastSupportCount(0),
+	rangeFrames(),
+	targetFrameTime(bvs.config.getValue<float>(info.conf+".targetFrameTime", 0)),
+	qualityHysteresis(bvs.config.getValue<float>(info.conf+".qualityHysteresis", 0.15f)),
+	qualityPatience(bvs.config.getValue<int>(info.conf+".qualityPatience", 5)),
+	maxQualityLevel(bvs.config.getValue<int>(info.conf+".maxQualityLevel", 5)),
+	qualityLevel(0),
+	qualityHold(0),
+	frameTime(0),
+	levelScale(1),
+	foveated(bvs.config.getValue<bool>(info.conf+".foveated", false)),
+	foveaCoarseScale(bvs.config.getValue<float>(info.conf+".foveaCoarseScale", 2)),
+	foveaROIs(),
+	foveaHorizonBand(bvs.config.getValue<int>(info.conf+".foveaHorizonBand", 0)),
+	horizonRow(-1),
+	baselines(),
+	frameNumber(0),
+	rigs(),
+	rigPriorityScheduling(bvs.config.getValue<std::string>(info.conf+".rigScheduling", "fair")=="priority"),
+	primaryPriority(0),
+	rigRound(0),
+	rigExit(false),
+	rigPending(0),
+	rigJobs(),
+	rigMutex(),
+	rigWork(),
+	rigDone(),
+	rigWorkers(),
 	runningThreads(0),
 	masterMutex(),
 	sliceMutex(),
@@ -32,9 +92,29 @@ StereoELAS::StereoELAS(BVS::ModuleInfo info, const BVS::Info& bvs)
 	right(),
 	dispL(),
 	dispR(),
+	outDispL(),
+	outDispR(),
+	upDispL(),
+	upDispR(),
+	resultL(),
+	resultR(),
+	coarseL(),
+	coarseR(),
+	coarseDispL(),
+	coarseDispR(),
+	foveaDispL(),
+	foveaDispR(),
+	validity(),
+	outValidity(),
+	support(),
+	triangles(),
+	sparseSupport(),
+	sparseTriangles(),
 	dimensions(),
+	baseParam(),
 	param(),
-	elas(param)
+	elas(param),
+	foveaElas(param)
 {
 	if (sliceCount<=0)
 	{
@@ -51,7 +131,57 @@ StereoELAS::StereoELAS(BVS::ModuleInfo info, const BVS::Info& bvs)
 	param.postprocess_only_left = false;
 	param.add_corners = true;
 	param.ipol_gap_width = 30;
+	param.subsampling = bvs.config.getValue<bool>(info.conf+".subsampling", false);
 	elas = Elas(param);
+	baseParam = param;
+	fullDispMin = param.disp_min;
+	fullDispMax = param.disp_max;
+	if (rangeHistory<1) rangeHistory = 1;
+	maxQualityLevel = std::max(0, std::min(maxQualityLevel, 5));
+
+	if (foveated)
+	{
+		bvs.config.getValue<int>(info.conf+".foveaROIs", foveaROIs);
+		if (foveaROIs.size()%4) LOG(0, "foveaROIs must be given as x, y, width, height quadruples!");
+		if (foveaCoarseScale<1) foveaCoarseScale = 1;
+		sparseOnly = false;
+		rowPriors = false;
+		trackRange = false;
+	}
+
+	int numBaselines = bvs.config.getValue<int>(info.conf+".numBaselines", 0);
+	baselines.resize(std::max(numBaselines, 0));
+	for (int i=0; i<numBaselines; i++)
+	{
+		std::string id = std::to_string(i+1);
+		baselines[i].in.reset(new BVS::Connector<cv::Mat>("inB"+id, BVS::ConnectorType::INPUT));
+		baselines[i].out.reset(new BVS::Connector<cv::Mat>("outB"+id, BVS::ConnectorType::OUTPUT));
+		baselines[i].ready = false;
+	}
+
+	int numRigs = bvs.config.getValue<int>(info.conf+".numRigs", 0);
+	if (numRigs>0)
+	{
+		std::vector<int> priorities;
+		bvs.config.getValue<int>(info.conf+".rigPriorities", priorities);
+		priorities.resize(numRigs+1, 0);
+		primaryPriority = priorities[0];
+		rigs.resize(numRigs);
+		for (int i=0; i<numRigs; i++)
+		{
+			std::string id = std::to_string(i+1);
+			rigs[i].inL.reset(new BVS::Connector<cv::Mat>("inL"+id, BVS::ConnectorType::INPUT));
+			rigs[i].inR.reset(new BVS::Connector<cv::Mat>("inR"+id, BVS::ConnectorType::INPUT));
+			rigs[i].outL.reset(new BVS::Connector<cv::Mat>("outL"+id, BVS::ConnectorType::OUTPUT));
+			rigs[i].outR.reset(new BVS::Connector<cv::Mat>("outR"+id, BVS::ConnectorType::OUTPUT));
+			rigs[i].priority = priorities[i+1];
+			rigs[i].ready = false;
+		}
+
+		int rigThreads = bvs.config.getValue<int>(info.conf+".rigThreads", 0);
+		if (rigThreads<=0) rigThreads = std::min<int>(numRigs+1, std::max(1u, std::thread::hardware_concurrency()));
+		for (int i=0; i<rigThreads; i++) rigWorkers.push_back(std::thread(&StereoELAS::rigWorker, this));
+	}
 
 	if (sliceCount!=1)
 	{
@@ -62,14 +192,7 @@ StereoELAS::StereoELAS(BVS::ModuleInfo info, const BVS::Info& bvs)
 		for (auto f: flags) f = false;
 	}
 
-	if (showDisparities)
-	{
-		cv::namedWindow("bvs-elas-in-left", 0);
-		cv::namedWindow("bvs-elas-in-right", 0);
-		cv::namedWindow("bvs-elas-disp-left", 0);
-		cv::namedWindow("bvs-elas-disp-right", 0);
-		cv::startWindowThread();
-	}
+	if (showDisparities) Preview::instance().configure(bvs);
 }
 
 
@@ -84,16 +207,87 @@ StereoELAS::~StereoELAS()
 		threadMonitor.notify_all();
 		for (auto& t: threads) if (t.joinable()) t.join();
 	}
-	if (showDisparities) cv::destroyAllWindows();
+	{
+		std::lock_guard<std::mutex> lock(rigMutex);
+		rigExit = true;
+	}
+	rigWork.notify_all();
+	for (auto& t: rigWorkers) if (t.joinable()) t.join();
+	if (showDisparities)
+		for (auto window: {"bvs-elas-in-left", "bvs-elas-in-right", "bvs-elas-disp-left", "bvs-elas-disp-right"})
+			Preview::instance().close(window);
 }
 
 
 
 BVS::Status StereoELAS::execute()
 {
-	if (!inL.receive(tmpL) || !inR.receive(tmpR)) return BVS::Status::NOINPUT;
-	if (tmpL.empty() || tmpR.empty()) return BVS::Status::NOINPUT;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	bool primary = inL.receive(tmpL) && inR.receive(tmpR) && !tmpL.empty() && !tmpR.empty();
+	for (auto& b: baselines) b.ready = primary && b.in->receive(b.tmp) && !b.tmp.empty();
+	if (rigs.empty())
+	{
+		if (!primary) return BVS::Status::NOINPUT;
+		processFrame();
+	}
+	else if (!scheduleRigs(primary)) return BVS::Status::NOINPUT;
+
+	for (auto& rig: rigs)
+	{
+		if (!rig.ready) continue;
+		rig.outL->send(rig.dispL);
+		rig.outR->send(rig.dispR);
+	}
+	if (!primary) return BVS::Status::OK;
 
+	for (auto& b: baselines) if (b.ready) b.out->send(b.result);
+	if (!sparseOnly || sparseRasterize) outL.send(resultL);
+	if (!sparseOnly) outR.send(resultR);
+	sendSparse();
+	if (foveated && outMask.active())
+	{
+		if (validity.size()==resultL.size()) outMask.send(validity);
+		else
+		{
+			cv::resize(validity, outValidity, resultL.size(), 0, 0, cv::INTER_NEAREST);
+			outMask.send(outValidity);
+		}
+	}
+
+	if (targetFrameTime>0)
+	{
+		updateQuality(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now()-start).count());
+		outQuality.send(qualityLevel);
+	}
+
+	// scaling and drawing is done by the preview's GUI thread
+	if (showDisparities)
+	{
+		LOG(3, "fps: " << bvs.getFPS());
+		std::string fps = bvs.getFPS();
+		auto scale = [](const cv::Mat& disparity, cv::Mat& shown) {
+			double disp_max = 0;
+			cv::minMaxLoc(disparity, nullptr, &disp_max);
+			disparity.convertTo(shown, CV_8U, 255.0/std::max(disp_max, 1.0));
+		};
+		Preview& preview = Preview::instance();
+		preview.show("bvs-elas-in-left", left);
+		preview.show("bvs-elas-in-right", right);
+		if (sparseOnly && !sparseRasterize) return BVS::Status::OK;
+		preview.show("bvs-elas-disp-left", resultL, [scale, fps](const cv::Mat& disparity, cv::Mat& shown) {
+			scale(disparity, shown);
+			cv::putText(shown, fps, cv::Point(10, 30), CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(255, 255, 255), 2);
+		});
+		preview.show("bvs-elas-disp-right", resultR, scale);
+	}
+
+	return BVS::Status::OK;
+}
+
+
+
+void StereoELAS::processFrame()
+{
 	if (tmpL.type()!=CV_8UC1 || tmpR.type()!=CV_8UC1)
 	{
 		cv::Mat greyL, greyR;
@@ -103,16 +297,20 @@ BVS::Status StereoELAS::execute()
 		tmpR = greyR;
 	}
 
-	cv::resize(tmpL, left, cv::Size(tmpL.cols/scalingFactor, tmpL.rows/scalingFactor), 0, 0, cv::INTER_AREA);
-	cv::resize(tmpR, right, cv::Size(tmpR.cols/scalingFactor, tmpR.rows/scalingFactor), 0, 0, cv::INTER_AREA);
+	cv::Size outSize(tmpL.cols/scalingFactor, tmpL.rows/scalingFactor);
+	float scale = scalingFactor*levelScale;
+	cv::resize(tmpL, left, cv::Size(tmpL.cols/scale, tmpL.rows/scale), 0, 0, cv::INTER_AREA);
+	cv::resize(tmpR, right, cv::Size(tmpR.cols/scale, tmpR.rows/scale), 0, 0, cv::INTER_AREA);
 
-	if (dispL.size()==cv::Size())
+	cv::Size dispSize = param.subsampling && !foveated ? cv::Size(left.cols/2, left.rows/2) : left.size();
+	if (dispL.size()!=dispSize)
 	{
-		dispL = cv::Mat(left.size(), CV_32FC1);
-		dispR = cv::Mat(left.size(), CV_32FC1);
+		dispL = cv::Mat(dispSize, CV_32FC1, cv::Scalar(-10));
+		dispR = cv::Mat(dispSize, CV_32FC1, cv::Scalar(-10));
 		dimensions[0] = left.cols;
 		dimensions[1] = (left.rows-discardTopLines-discardBottomLines)/sliceCount; //TODO + sliceOverlap;
 		dimensions[2] = dimensions[0];
+		rowBoundsValid = false;
 	}
 
 	if (sliceCount!=1)
@@ -122,40 +320,165 @@ BVS::Status StereoELAS::execute()
 		threadMonitor.notify_all();
 		monitor.wait(masterLock, [&](){ return runningThreads.load()==0; });
 	}
+	else if (foveated)
+	{
+		processFoveated();
+	}
 	else
 	{
-		elas.process(left.data, right.data, (float*)dispL.data, (float*)dispR.data, dimensions);
+		bool useRowPriors = rowPriors && !param.subsampling && (!sparseOnly || sparseRasterize);
+		if (useRowPriors && rowBoundsValid) elas.setRowBounds(rowMin.data(), rowMax.data(), dimensions[1]);
+		else elas.clearRowBounds();
+		if (sparseOnly)
+			elas.processSparse(left.data, right.data, dimensions, sparseSupport, sparseTriangles,
+					sparseRasterize ? (float*)dispL.data : nullptr);
+		else if (bandHeight>0)
+			elas.processBands(left.data, right.data, (float*)dispL.data, (float*)dispR.data, dimensions, bandHeight);
+		else
+			elas.process(left.data, right.data, (float*)dispL.data, (float*)dispR.data, dimensions, baselines.empty() ? -1 : frameNumber);
+		rowBoundsValid = useRowPriors && updateRowBounds();
+		if (trackRange) updateDisparityRange();
 	}
 
-	outL.send(dispL);
-	outR.send(dispR);
+	processBaselines(outSize);
+	frameNumber++;
 
-	if (showDisparities)
+	// without rasterizing, sparse mode leaves dispL untouched and sends no dense disparity
+	if (sparseOnly && !sparseRasterize) return;
+
+	if (dispL.size()!=left.size())
 	{
-		float disp_max = 0;
-		for (int32_t i=0; i<left.cols*left.rows; i++) {
-			if (*((float*)dispL.data+i)>disp_max) disp_max = *((float*)dispL.data+i);
-			if (*((float*)dispR.data+i)>disp_max) disp_max = *((float*)dispR.data+i);
-		}
+		upsample(dispL, left, upDispL);
+		if (!sparseOnly) upsample(dispR, right, upDispR);
+		resultL = toOutputSize(upDispL, outDispL, outSize);
+		resultR = sparseOnly ? resultL : toOutputSize(upDispR, outDispR, outSize);
+	}
+	else
+	{
+		resultL = toOutputSize(dispL, outDispL, outSize);
+		resultR = sparseOnly ? resultL : toOutputSize(dispR, outDispR, outSize);
+	}
+}
 
-		cv::Mat showL = cv::Mat(left.size(), CV_8UC1);
-		cv::Mat showR = cv::Mat(left.size(), CV_8UC1);
-		for (int32_t i=0; i<left.cols*left.rows; i++) {
-			*(showL.data+i) = (uint8_t)std::max(255.0* *((float*)dispL.data+i)/disp_max,0.0);
-			*(showR.data+i) = (uint8_t)std::max(255.0* *((float*)dispR.data+i)/disp_max,0.0);
+
+
+void StereoELAS::processBaselines(cv::Size outSize)
+{
+	if (baselines.empty()) return;
+
+	// other baselines see other disparities, so neither the tracked range nor
+	// the row priors of inL/inR apply, param holds the tracked range as well
+	Elas::parameters tracked = elas.getParameters();
+	Elas::parameters full = param;
+	full.disp_min = fullDispMin;
+	full.disp_max = fullDispMax;
+	elas.setParameters(full);
+	elas.clearRowBounds();
+	int dims[3] = {left.cols, left.rows, (int)left.step};
+	cv::Size dispSize = param.subsampling ? cv::Size(left.cols/2, left.rows/2) : left.size();
+
+	for (auto& b: baselines)
+	{
+		if (!b.ready) continue;
+		if (b.tmp.type()!=CV_8UC1) cv::cvtColor(b.tmp, b.tmp, CV_RGB2GRAY);
+		cv::resize(b.tmp, b.image, left.size(), 0, 0, cv::INTER_AREA);
+		b.dispL.create(dispSize, CV_32FC1);
+		b.dispR.create(dispSize, CV_32FC1);
+		elas.process(left.data, b.image.data, (float*)b.dispL.data, (float*)b.dispR.data, dims, frameNumber);
+
+		if (dispSize!=left.size())
+		{
+			upsample(b.dispL, left, b.upDisp);
+			b.result = toOutputSize(b.upDisp, b.outDisp, outSize);
 		}
+		else b.result = toOutputSize(b.dispL, b.outDisp, outSize);
+	}
+	elas.setParameters(tracked);
+}
 
-		LOG(3, "fps: " << bvs.getFPS());
-		cv::putText(showL, bvs.getFPS(), cv::Point(10, 30),
-				CV_FONT_HERSHEY_SIMPLEX, 1.0f, cvScalar(255, 255, 255), 2);
-		cv::imshow("bvs-elas-in-left", left);
-		cv::imshow("bvs-elas-in-right", right);
-		cv::imshow("bvs-elas-disp-left", showL);
-		cv::imshow("bvs-elas-disp-right", showR);
-		cv::waitKey(1);
+
+
+bool StereoELAS::scheduleRigs(bool primary)
+{
+	std::vector<std::pair<int, RigJob>> batch;
+	if (primary) batch.emplace_back(primaryPriority, [this](Workspaces&){ processFrame(); });
+	for (auto& rig: rigs)
+	{
+		rig.ready = rig.inL->receive(rig.tmpL) && rig.inR->receive(rig.tmpR) && !rig.tmpL.empty() && !rig.tmpR.empty();
+		if (rig.ready) batch.emplace_back(rig.priority, [this, &rig](Workspaces& spaces){ processRig(rig, spaces); });
 	}
+	if (batch.empty()) return false;
+
+	// priority: highest first, fair: rotate the start so no pair always finishes last
+	if (rigPriorityScheduling)
+		std::stable_sort(batch.begin(), batch.end(),
+				[](const std::pair<int, RigJob>& a, const std::pair<int, RigJob>& b){ return a.first>b.first; });
+	else std::rotate(batch.begin(), batch.begin()+rigRound++%batch.size(), batch.end());
+
+	std::unique_lock<std::mutex> lock(rigMutex);
+	for (auto& job: batch) rigJobs.push_back(std::move(job.second));
+	rigPending = batch.size();
+	rigWork.notify_all();
+	rigDone.wait(lock, [&](){ return rigPending==0; });
+	return true;
+}
 
-	return BVS::Status::OK;
+
+
+void StereoELAS::processRig(Rig& rig, Workspaces& spaces)
+{
+	cv::Mat tmpL = rig.tmpL;
+	cv::Mat tmpR = rig.tmpR;
+	if (tmpL.type()!=CV_8UC1 || tmpR.type()!=CV_8UC1)
+	{
+		cv::cvtColor(rig.tmpL, tmpL, CV_RGB2GRAY);
+		cv::cvtColor(rig.tmpR, tmpR, CV_RGB2GRAY);
+	}
+
+	// workspaces are shared by all pairs of the same size
+	cv::Size size(tmpL.cols/scalingFactor, tmpL.rows/scalingFactor);
+	std::unique_ptr<Workspace>& space = spaces[std::make_pair(size.width, size.height)];
+	Elas::parameters rigParam = baseParam;
+	if (!space) space.reset(new Workspace(rigParam));
+	cv::resize(tmpL, space->left, size, 0, 0, cv::INTER_AREA);
+	cv::resize(tmpR, space->right, size, 0, 0, cv::INTER_AREA);
+
+	// the previous disparities may still be referenced by receivers
+	rig.dispL = cv::Mat(size, CV_32FC1);
+	rig.dispR = cv::Mat(size, CV_32FC1);
+	int32_t dims[3] = {size.width, size.height, (int32_t)space->left.step};
+	if (rigParam.subsampling)
+	{
+		space->subDispL.create(size.height/2, size.width/2, CV_32FC1);
+		space->subDispR.create(size.height/2, size.width/2, CV_32FC1);
+		space->elas.process(space->left.data, space->right.data, (float*)space->subDispL.data, (float*)space->subDispR.data, dims);
+		upsample(space->subDispL, space->left, rig.dispL);
+		upsample(space->subDispR, space->right, rig.dispR);
+	}
+	else space->elas.process(space->left.data, space->right.data, (float*)rig.dispL.data, (float*)rig.dispR.data, dims);
+}
+
+
+
+void StereoELAS::rigWorker()
+{
+	BVS::nameThisThread("elas.rig");
+	Workspaces spaces;
+	std::unique_lock<std::mutex> lock(rigMutex);
+
+	while (true)
+	{
+		rigWork.wait(lock, [&](){ return rigExit || !rigJobs.empty(); });
+		if (rigExit) break;
+
+		RigJob job = std::move(rigJobs.front());
+		rigJobs.pop_front();
+		lock.unlock();
+		job(spaces);
+		lock.lock();
+
+		if (--rigPending==0) rigDone.notify_one();
+	}
 }
 
 
@@ -182,6 +505,381 @@ void StereoELAS::sliceThread(int id)
 
 
 
+void StereoELAS::processFoveated()
+{
+	Elas::parameters p = param;
+	p.subsampling = false;
+
+	// coarse pass over the whole frame
+	cv::Size coarseSize(left.cols/foveaCoarseScale, left.rows/foveaCoarseScale);
+	cv::resize(left, coarseL, coarseSize, 0, 0, cv::INTER_AREA);
+	cv::resize(right, coarseR, coarseSize, 0, 0, cv::INTER_AREA);
+	if (coarseDispL.size()!=coarseSize)
+	{
+		coarseDispL = cv::Mat(coarseSize, CV_32FC1);
+		coarseDispR = cv::Mat(coarseSize, CV_32FC1);
+	}
+	Elas::parameters coarseParam = p;
+	coarseParam.disp_max = std::ceil(p.disp_max/foveaCoarseScale);
+	int coarseDims[3] = {coarseL.cols, coarseL.rows, (int)coarseL.step};
+	elas.clearRowBounds();
+	elas.setParameters(coarseParam);
+	elas.process(coarseL.data, coarseR.data, (float*)coarseDispL.data, (float*)coarseDispR.data, coarseDims);
+	elas.setParameters(param);
+
+	// upsample coarse disparities to processing resolution
+	double factor = (double)left.cols/coarseL.cols;
+	cv::resize(coarseDispL, dispL, left.size(), 0, 0, cv::INTER_NEAREST);
+	cv::resize(coarseDispR, dispR, left.size(), 0, 0, cv::INTER_NEAREST);
+	dispL.convertTo(dispL, CV_32F, factor);
+	dispR.convertTo(dispR, CV_32F, factor);
+	cv::max(dispL, -10.0, dispL);
+	cv::max(dispR, -10.0, dispR);
+	validity.create(left.size(), CV_8UC1);
+	for (int v=0; v<left.rows; v++)
+	{
+		const float* d = dispL.ptr<float>(v);
+		uchar* m = validity.ptr<uchar>(v);
+		for (int u=0; u<left.cols; u++) m[u] = d[u]>=0 ? 1 : 0;
+	}
+
+	// full resolution passes, crops are widened by the disparity range so
+	// matches of the ROI's border pixels stay inside the crop
+	foveaElas.setParameters(p);
+	for (const auto& roi: foveaRegions())
+	{
+		int x0 = std::max(roi.x-p.disp_max, 0);
+		int x1 = std::min(roi.x+roi.width+p.disp_max, left.cols);
+		// elas copies whole lines if its padded width equals the step, which
+		// would read past the image for a shifted crop
+		if ((x1-x0+15-(x1-x0-1)%16)==(int)left.step) x0 = 0;
+		cv::Rect crop(x0, roi.y, x1-x0, roi.height);
+		foveaDispL.create(crop.size(), CV_32FC1);
+		foveaDispR.create(crop.size(), CV_32FC1);
+		int dims[3] = {crop.width, crop.height, (int)left.step};
+		foveaElas.process(left.ptr<uchar>(crop.y)+crop.x, right.ptr<uchar>(crop.y)+crop.x,
+				(float*)foveaDispL.data, (float*)foveaDispR.data, dims);
+
+		for (int v=0; v<roi.height; v++)
+		{
+			const float* fl = foveaDispL.ptr<float>(v)+roi.x-x0;
+			const float* fr = foveaDispR.ptr<float>(v)+roi.x-x0;
+			float* dl = dispL.ptr<float>(roi.y+v)+roi.x;
+			float* dr = dispR.ptr<float>(roi.y+v)+roi.x;
+			uchar* m = validity.ptr<uchar>(roi.y+v)+roi.x;
+			for (int u=0; u<roi.width; u++)
+			{
+				if (fl[u]>=0) { dl[u] = fl[u]; m[u] = 2; }
+				if (fr[u]>=0) dr[u] = fr[u];
+			}
+		}
+	}
+}
+
+
+
+std::vector<cv::Rect> StereoELAS::foveaRegions()
+{
+	std::vector<cv::Rect> rois;
+	cv::Rect image(0, 0, left.cols, left.rows);
+	float toProc = 1.0f/levelScale;
+
+	for (size_t i=0; i+3<foveaROIs.size(); i+=4)
+		rois.push_back(cv::Rect(foveaROIs[i]*toProc, foveaROIs[i+1]*toProc,
+					foveaROIs[i+2]*toProc, foveaROIs[i+3]*toProc) & image);
+
+	// horizon: row with the smallest mean disparity (far field) that has enough support
+	if (foveaHorizonBand>0)
+	{
+		int best = -1;
+		float bestMean = FLT_MAX;
+		for (int v=0; v<coarseDispL.rows; v++)
+		{
+			const float* d = coarseDispL.ptr<float>(v);
+			float sum = 0;
+			int count = 0;
+			for (int u=0; u<coarseDispL.cols; u++) if (d[u]>=0) { sum += d[u]; count++; }
+			if (count<0.2*coarseDispL.cols) continue;
+			if (sum/count<bestMean)
+			{
+				bestMean = sum/count;
+				best = v;
+			}
+		}
+		if (best>=0)
+		{
+			double row = (best+0.5)*left.rows/coarseDispL.rows;
+			horizonRow = horizonRow<0 ? row : 0.7*horizonRow+0.3*row;
+		}
+		if (horizonRow>=0)
+		{
+			int band = foveaHorizonBand*toProc;
+			rois.push_back(cv::Rect(0, horizonRow-band/2, left.cols, band) & image);
+		}
+	}
+
+	// ELAS needs some area to find support points
+	rois.erase(std::remove_if(rois.begin(), rois.end(),
+				[](const cv::Rect& r){ return r.width<32 || r.height<32; }), rois.end());
+	return rois;
+}
+
+
+
+void StereoELAS::upsample(const cv::Mat& src, const cv::Mat& guide, cv::Mat& dst)
+{
+	dst.create(guide.size(), CV_32FC1);
+	filter::upsample_guided((const float*)src.data, guide.data, guide.step, (float*)dst.data, guide.cols, guide.rows, upsampleSigma);
+}
+
+
+
+const cv::Mat& StereoELAS::toOutputSize(const cv::Mat& src, cv::Mat& dst, cv::Size size)
+{
+	if (src.size()==size) return src;
+
+	// disparities are given in units of the processed (left) image width
+	cv::resize(src, dst, size, 0, 0, cv::INTER_NEAREST);
+	dst.convertTo(dst, CV_32F, (double)size.width/left.cols);
+	cv::max(dst, -10.0, dst);
+	return dst;
+}
+
+
+
+void StereoELAS::updateQuality(double ms)
+{
+	frameTime = frameTime>0 ? 0.8*frameTime+0.2*ms : ms;
+	if (++qualityHold<qualityPatience) return;
+
+	int level = qualityLevel;
+	if (frameTime>targetFrameTime*(1+qualityHysteresis) && level<maxQualityLevel) level++;
+	else if (frameTime<targetFrameTime*(1-qualityHysteresis) && level>0) level--;
+	if (level==qualityLevel) return;
+
+	LOG(2, "frame time " << frameTime << "ms (target: " << targetFrameTime << "ms), quality level: " << qualityLevel << " -> " << level);
+	qualityLevel = level;
+	qualityHold = 0;
+	frameTime = 0;
+	applyQualityLevel();
+}
+
+
+
+void StereoELAS::applyQualityLevel()
+{
+	param = baseParam;
+	levelScale = qualityLevel>=5 ? 2.0f : qualityLevel>=4 ? 1.5f : 1.0f;
+	if (qualityLevel>=1)
+	{
+		param.filter_adaptive_mean = false;
+		param.filter_median = false;
+	}
+	if (qualityLevel>=2) param.candidate_stepsize = baseParam.candidate_stepsize+2;
+	if (qualityLevel>=3) param.subsampling = true;
+	param.disp_max = std::ceil(baseParam.disp_max/levelScale);
+
+	// restart range tracking and row priors for the new disparity scale
+	fullDispMin = param.disp_min;
+	fullDispMax = param.disp_max;
+	rangeFrames.clear();
+	lastSupportCount = 0;
+	rowBoundsValid = false;
+	elas.setParameters(param);
+}
+
+
+
+void StereoELAS::sendSparse()
+{
+	if (outSupport.active())
+	{
+		const std::vector<Elas::support_pt>& points = elas.getSupportPoints();
+		support.create(points.size(), 3, CV_32SC1);
+		for (size_t i=0; i<points.size(); i++)
+		{
+			int* row = support.ptr<int>(i);
+			row[0] = points[i].u;
+			row[1] = points[i].v;
+			row[2] = points[i].d;
+		}
+		outSupport.send(support);
+	}
+
+	if (sparseOnly && outTriangles.active())
+	{
+		triangles.create(sparseTriangles.size(), 6, CV_32FC1);
+		for (size_t i=0; i<sparseTriangles.size(); i++)
+		{
+			const Elas::triangle& t = sparseTriangles[i];
+			float* row = triangles.ptr<float>(i);
+			row[0] = t.c1;
+			row[1] = t.c2;
+			row[2] = t.c3;
+			row[3] = t.t1a;
+			row[4] = t.t1b;
+			row[5] = t.t1c;
+		}
+		outTriangles.send(triangles);
+	}
+}
+
+
+
+bool StereoELAS::updateRowBounds()
+{
+	const int rows = dimensions[1];
+	const int cols = dimensions[0];
+	const int dMin = std::max(param.disp_min, 0);
+	const int dMax = param.disp_max;
+	const int minWidth = 2*rowPriorMargin+10;
+
+	// check whether the last frame pushed against its bounds (e.g. scene cut)
+	if (rowBoundsValid)
+	{
+		int valid = 0;
+		int saturated = 0;
+		for (int v=0; v<rows; v++)
+		{
+			const float* d = dispL.ptr<float>(v);
+			for (int u=0; u<cols; u++)
+			{
+				if (d[u]<0) continue;
+				valid++;
+				if ((rowMin[v]>dMin && d[u]<=rowMin[v]+1) || (rowMax[v]<dMax && d[u]>=rowMax[v]-1)) saturated++;
+			}
+		}
+		if (valid==0 || saturated>rowPriorMaxSaturation*valid)
+		{
+			LOG(2, "row priors saturated (" << saturated << "/" << valid << "), using full disparity range!");
+			return false;
+		}
+	}
+
+	// v-disparity: robust disparity range of each row
+	std::vector<int> hist(dMax+1);
+	std::vector<int32_t> lo(rows, dMin);
+	std::vector<int32_t> hi(rows, dMax);
+	int boundedRows = 0;
+	for (int v=0; v<rows; v++)
+	{
+		std::fill(hist.begin(), hist.end(), 0);
+		int valid = 0;
+		const float* d = dispL.ptr<float>(v);
+		for (int u=0; u<cols; u++)
+		{
+			if (d[u]<0) continue;
+			hist[std::min((int)d[u], dMax)]++;
+			valid++;
+		}
+		if (valid==0 || valid<rowPriorMinValid*cols) continue;
+
+		int outliers = rowPriorQuantile*valid;
+		int acc = 0;
+		int i = 0;
+		for (i=0; i<dMax; i++) if ((acc += hist[i])>outliers) break;
+		lo[v] = i;
+		acc = 0;
+		for (i=dMax; i>0; i--) if ((acc += hist[i])>outliers) break;
+		hi[v] = i;
+		boundedRows++;
+	}
+	if (boundedRows==0) return false;
+
+	// smooth across neighbouring rows and add the safety margin
+	const int window = 2;
+	rowMin.resize(rows);
+	rowMax.resize(rows);
+	for (int v=0; v<rows; v++)
+	{
+		int32_t l = lo[v];
+		int32_t h = hi[v];
+		for (int w=std::max(v-window, 0); w<=std::min(v+window, rows-1); w++)
+		{
+			l = std::min(l, lo[w]);
+			h = std::max(h, hi[w]);
+		}
+		l = std::max(l-rowPriorMargin, dMin);
+		h = std::min(h+rowPriorMargin, dMax);
+		if (h-l<minWidth)
+		{
+			int grow = (minWidth-(h-l)+1)/2;
+			l = std::max(l-grow, dMin);
+			h = std::min(h+grow, dMax);
+		}
+		rowMin[v] = l;
+		rowMax[v] = h;
+	}
+
+	return true;
+}
+
+
+
+void StereoELAS::updateDisparityRange()
+{
+	const std::vector<Elas::support_pt>& support = elas.getSupportPoints();
+	std::function<void(std::string)> reset = [&](std::string reason) {
+		LOG(2, "disparity range reset (" << reason << "): " << fullDispMin << "-" << fullDispMax);
+		rangeFrames.clear();
+		param.disp_min = fullDispMin;
+		param.disp_max = fullDispMax;
+		elas.setParameters(param);
+	};
+
+	// scene cut: support collapsed or piles up at the range limits
+	size_t saturated = 0;
+	for (const auto& p: support)
+		if ((param.disp_min>fullDispMin && p.d<=param.disp_min+1) || (param.disp_max<fullDispMax && p.d>=param.disp_max-1)) saturated++;
+	bool cut = support.size()<rangeSceneCut*lastSupportCount;
+	lastSupportCount = support.size();
+	if (support.empty() || cut || saturated>rangeMaxSaturation*support.size())
+	{
+		if (param.disp_min!=fullDispMin || param.disp_max!=fullDispMax)
+			reset(support.empty() ? "no support" : cut ? "scene cut" : "saturated");
+		else rangeFrames.clear();
+		return;
+	}
+
+	// robust range of this frame's support points
+	std::vector<int> d;
+	d.reserve(support.size());
+	for (const auto& p: support) d.push_back(p.d);
+	size_t outliers = rangeQuantile*d.size();
+	std::nth_element(d.begin(), d.begin()+outliers, d.end());
+	int lo = d[outliers];
+	std::nth_element(d.begin(), d.end()-1-outliers, d.end());
+	int hi = d[d.size()-1-outliers];
+	rangeFrames.emplace_back(lo, hi);
+	while ((int)rangeFrames.size()>rangeHistory) rangeFrames.pop_front();
+
+	// target range over recent frames
+	for (const auto& f: rangeFrames)
+	{
+		lo = std::min(lo, f.first);
+		hi = std::max(hi, f.second);
+	}
+	lo = std::max(lo-rangeMargin, fullDispMin);
+	hi = std::min(hi+rangeMargin, fullDispMax);
+	if (hi-lo<2*rangeMargin+10) hi = std::min(lo+2*rangeMargin+10, fullDispMax);
+
+	// grow immediately, shrink with hysteresis once history is complete
+	int dMin = param.disp_min;
+	int dMax = param.disp_max;
+	bool settled = (int)rangeFrames.size()==rangeHistory;
+	if (lo<dMin || (settled && lo-dMin>rangeHysteresis)) dMin = lo;
+	if (hi>dMax || (settled && dMax-hi>rangeHysteresis)) dMax = hi;
+	if (dMin!=param.disp_min || dMax!=param.disp_max)
+	{
+		LOG(3, "disparity range: " << dMin << "-" << dMax);
+		param.disp_min = dMin;
+		param.disp_max = dMax;
+		elas.setParameters(param);
+	}
+}
+
+
+
 BVS::Status StereoELAS::debugDisplay()
 {
 	return BVS::Status::OK;
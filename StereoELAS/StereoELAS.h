@@ -6,7 +6,12 @@
 #include "elas.h"
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
 #include <thread>
+#include <utility>
 #include <vector>
 
 
@@ -66,6 +71,10 @@ class StereoELAS : public BVS::Module
 		BVS::Connector<cv::Mat> inR;
 		BVS::Connector<cv::Mat> outL;
 		BVS::Connector<cv::Mat> outR;
+		BVS::Connector<cv::Mat> outSupport; /**< Support points, Nx3 CV_32SC1 (u, v, d). */
+		BVS::Connector<cv::Mat> outTriangles; /**< Triangles, Mx6 CV_32FC1 (c1, c2, c3, a, b, c) with d = a*u+b*v+c. */
+		BVS::Connector<int> outQuality; /**< Current quality level (0 = configured quality). */
+		BVS::Connector<cv::Mat> outMask; /**< Foveated validity mask, CV_8UC1 (0: invalid, 1: coarse, 2: fovea). */
 
 		int discardTopLines;
 		int discardBottomLines;
@@ -74,6 +83,106 @@ class StereoELAS : public BVS::Module
 		int sliceOverlap;
 		bool showDisparities;
 		bool sliceExit;
+		bool sparseOnly; /**< Stop after support points, triangulation and planes. */
+		bool sparseRasterize; /**< Rasterize the planes into dispL in sparse mode. */
+		float upsampleSigma; /**< Intensity sigma of the guided upsampling after subsampling. */
+		int bandHeight; /**< Rows per band for band-streaming ELAS, 0 processes full frames. */
+
+		bool rowPriors; /**< Restrict disparity search per row using the previous frame. */
+		int rowPriorMargin; /**< Safety margin added to the estimated row bounds. */
+		float rowPriorQuantile; /**< Fraction of outliers discarded on each side of a row. */
+		float rowPriorMinValid; /**< Minimum fraction of valid pixels to bound a row. */
+		float rowPriorMaxSaturation; /**< Fraction of pixels at the bounds forcing a fallback. */
+		bool rowBoundsValid; /**< Whether rowMin/rowMax can be used for the next frame. */
+		std::vector<int32_t> rowMin; /**< Lower disparity bound per row. */
+		std::vector<int32_t> rowMax; /**< Upper disparity bound per row. */
+
+		bool trackRange; /**< Adapt global disparity range to recent support points. */
+		int rangeMargin; /**< Safety margin added to the tracked disparity range. */
+		float rangeQuantile; /**< Fraction of support point outliers discarded on each side. */
+		int rangeHistory; /**< Number of frames the tracked range is taken over. */
+		int rangeHysteresis; /**< Minimal change before the range is shrunk. */
+		float rangeMaxSaturation; /**< Fraction of support points at the range limits forcing a reset. */
+		float rangeSceneCut; /**< Relative drop of support points treated as a scene cut. */
+		int fullDispMin; /**< Disparity range minimum used when (re)starting. */
+		int fullDispMax; /**< Disparity range maximum used when (re)starting. */
+		size_t lastSupportCount; /**< Number of support points of the previous frame. */
+		std::deque<std::pair<int, int>> rangeFrames; /**< Robust support point range of recent frames. */
+
+		float targetFrameTime; /**< Frame time (ms) the quality controller aims for, 0 disables it. */
+		float qualityHysteresis; /**< Relative deviation from target before changing quality. */
+		int qualityPatience; /**< Minimum number of frames between quality changes. */
+		int maxQualityLevel; /**< Lowest quality (highest level) the controller may use. */
+		int qualityLevel; /**< Current quality level. */
+		int qualityHold; /**< Frames since the last quality change. */
+		double frameTime; /**< Smoothed frame time (ms). */
+		float levelScale; /**< Additional downscaling of the current quality level. */
+
+		bool foveated; /**< Coarse full frame pass plus full resolution ROIs. */
+		float foveaCoarseScale; /**< Downscaling of the coarse pass. */
+		std::vector<int> foveaROIs; /**< Static ROIs (x, y, width, height, ...) in output coordinates. */
+		int foveaHorizonBand; /**< Height of the dynamic horizon band ROI, 0 disables it. */
+		double horizonRow; /**< Smoothed horizon row (processing coordinates), <0 if unknown. */
+
+		/** Additional stereo pair, processed densely on the shared pool. */
+		struct Rig
+		{
+			std::unique_ptr<BVS::Connector<cv::Mat>> inL; /**< Left input (inL<N>). */
+			std::unique_ptr<BVS::Connector<cv::Mat>> inR; /**< Right input (inR<N>). */
+			std::unique_ptr<BVS::Connector<cv::Mat>> outL; /**< Left disparity (outL<N>). */
+			std::unique_ptr<BVS::Connector<cv::Mat>> outR; /**< Right disparity (outR<N>). */
+			cv::Mat tmpL; /**< Received left image. */
+			cv::Mat tmpR; /**< Received right image. */
+			cv::Mat dispL; /**< Left disparity, owned by the rig until sent. */
+			cv::Mat dispR; /**< Right disparity, owned by the rig until sent. */
+			int priority; /**< Scheduling priority, higher runs first. */
+			bool ready; /**< Received a pair this round. */
+			Rig() : inL(), inR(), outL(), outR(), tmpL(), tmpR(), dispL(), dispR(), priority(0), ready(false) {}
+		};
+
+		/** Scratch buffers and matcher of a pool worker, one per image size. */
+		struct Workspace
+		{
+			cv::Mat left; /**< Scaled grey left image. */
+			cv::Mat right; /**< Scaled grey right image. */
+			cv::Mat subDispL; /**< Left disparity at half size when subsampling. */
+			cv::Mat subDispR; /**< Right disparity at half size when subsampling. */
+			Elas elas; /**< Matcher, libelas keeps per call state. */
+			explicit Workspace(Elas::parameters param) : left(), right(), subDispL(), subDispR(), elas(param) {}
+		};
+		typedef std::map<std::pair<int, int>, std::unique_ptr<Workspace>> Workspaces;
+		typedef std::function<void(Workspaces&)> RigJob;
+
+		/** Additional partner camera matched against the left image of inL/inR. */
+		struct Baseline
+		{
+			std::unique_ptr<BVS::Connector<cv::Mat>> in; /**< Partner image (inB<N>). */
+			std::unique_ptr<BVS::Connector<cv::Mat>> out; /**< Left disparity (outB<N>). */
+			cv::Mat tmp; /**< Received partner image. */
+			cv::Mat image; /**< Scaled grey partner image. */
+			cv::Mat dispL; /**< Left disparity as computed by ELAS. */
+			cv::Mat dispR; /**< Partner disparity as computed by ELAS. */
+			cv::Mat upDisp; /**< Upsampled left disparity when subsampling. */
+			cv::Mat outDisp; /**< Left disparity at output size. */
+			cv::Mat result; /**< Left disparity to send. */
+			bool ready; /**< Received an image this round. */
+			Baseline() : in(), out(), tmp(), image(), dispL(), dispR(), upDisp(), outDisp(), result(), ready(false) {}
+		};
+
+		std::vector<Baseline> baselines; /**< Additional baselines sharing the left descriptor. */
+		int64_t frameNumber; /**< Processed frames, identifies the cached left descriptor. */
+
+		std::vector<Rig> rigs; /**< Additional stereo pairs. */
+		bool rigPriorityScheduling; /**< Order jobs by priority instead of round robin. */
+		int primaryPriority; /**< Scheduling priority of inL/inR. */
+		size_t rigRound; /**< Round counter for fair scheduling. */
+		bool rigExit; /**< Stop the pool. */
+		int rigPending; /**< Jobs of the current round not yet finished. */
+		std::deque<RigJob> rigJobs; /**< Jobs waiting for a worker. */
+		std::mutex rigMutex; /**< Protects rigJobs, rigPending and rigExit. */
+		std::condition_variable rigWork; /**< Signals new jobs to the pool. */
+		std::condition_variable rigDone; /**< Signals the end of a round. */
+		std::vector<std::thread> rigWorkers; /**< Shared pool. */
 
 		std::atomic<int> runningThreads;
 		std::mutex masterMutex;
@@ -90,12 +199,119 @@ class StereoELAS : public BVS::Module
 		cv::Mat right;
 		cv::Mat dispL;
 		cv::Mat dispR;
+		cv::Mat outDispL;
+		cv::Mat outDispR;
+		cv::Mat upDispL;
+		cv::Mat upDispR;
+		cv::Mat resultL;
+		cv::Mat resultR;
+		cv::Mat coarseL;
+		cv::Mat coarseR;
+		cv::Mat coarseDispL;
+		cv::Mat coarseDispR;
+		cv::Mat foveaDispL;
+		cv::Mat foveaDispR;
+		cv::Mat validity;
+		cv::Mat outValidity;
+		cv::Mat support;
+		cv::Mat triangles;
+		std::vector<Elas::support_pt> sparseSupport;
+		std::vector<Elas::triangle> sparseTriangles;
 		int dimensions[3];
+		Elas::parameters baseParam;
 		Elas::parameters param;
 		Elas elas;
+		Elas foveaElas;
 
 		void sliceThread(int id);
 
+		/** Compute the disparities of inL/inR into resultL/resultR. */
+		void processFrame();
+
+		/** Match the left image against all received partner images.
+		 * Uses the unrestricted parameters and reuses the left descriptor of
+		 * the current frame.
+		 * @param[in] outSize Output size.
+		 */
+		void processBaselines(cv::Size outSize);
+
+		/** Receive all pairs and process them on the shared pool.
+		 * Blocks until every received pair is done.
+		 * @param[in] primary Whether inL/inR delivered a pair.
+		 * @return False if no pair was received at all.
+		 */
+		bool scheduleRigs(bool primary);
+
+		/** Compute the disparities of an additional pair.
+		 * @param[in,out] rig The pair to process.
+		 * @param[in,out] spaces The calling worker's workspaces.
+		 */
+		void processRig(Rig& rig, Workspaces& spaces);
+
+		/** Pool worker, runs queued jobs until rigExit is set. */
+		void rigWorker();
+
+		/** Update the per row disparity bounds from the last left disparity.
+		 * Builds a v-disparity histogram from dispL and selects a robust
+		 * [min, max] range for each row, widened by rowPriorMargin. Rows with
+		 * too little support use the full disparity range.
+		 * @return False if the bounds were violated (saturated) or could not be
+		 * estimated, in which case the next frame uses the full range.
+		 */
+		bool updateRowBounds();
+
+		/** Track the global disparity range using the last support points.
+		 * Grows the range immediately, shrinks it only after the tracked range
+		 * stayed rangeHysteresis below the current limits and resets it to
+		 * the full range on scene cuts or saturated support points.
+		 */
+		void updateDisparityRange();
+
+		/** Foveated processing.
+		 * Runs ELAS on a by foveaCoarseScale downscaled frame, upsamples the
+		 * result into dispL/dispR and replaces it inside each ROI with a full
+		 * (processing) resolution ELAS pass. Sets the validity mask.
+		 */
+		void processFoveated();
+
+		/** Collect the foveal regions for the current frame.
+		 * @return Static ROIs and (if enabled) the horizon band, in processing
+		 * coordinates and clipped to the image.
+		 */
+		std::vector<cv::Rect> foveaRegions();
+
+		/** Send support points and (in sparse mode) triangles if requested. */
+		void sendSparse();
+
+		/** Upsample subsampled disparities to the size of the guide image.
+		 * @param[in] src Disparity map at half size, as computed by ELAS.
+		 * @param[in] guide Grey image the disparities were computed for.
+		 * @param[out] dst Disparity map at the size of guide.
+		 */
+		void upsample(const cv::Mat& src, const cv::Mat& guide, cv::Mat& dst);
+
+		/** Resize a disparity map to the output size, rescaling disparities.
+		 * @param[in] src Disparity map as computed by ELAS.
+		 * @param[out] dst Buffer for the resized map.
+		 * @param[in] size Output size.
+		 * @return src if it already has the output size, dst otherwise.
+		 */
+		const cv::Mat& toOutputSize(const cv::Mat& src, cv::Mat& dst, cv::Size size);
+
+		/** Feed the last frame time to the quality controller.
+		 * Degrades or improves the quality level by one step when the smoothed
+		 * frame time leaves the hysteresis band around targetFrameTime.
+		 * @param[in] ms Processing time of the last frame.
+		 */
+		void updateQuality(double ms);
+
+		/** Derive ELAS parameters and scaling from the current quality level.
+		 * Levels (cumulative): 1 -> no adaptive mean/median filter, 2 -> coarser
+		 * support point grid, 3 -> subsampling, 4/5 -> downscale by 1.5/2 with a
+		 * correspondingly smaller disparity range.
+		 */
+		void applyQualityLevel();
+
 		StereoELAS(const StereoELAS&) = delete; /**< -Weffc++ */
 		StereoELAS& operator=(const StereoELAS&) = delete; /**< -Weffc++ */
 };
@@ -28,25 +28,19 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 
 using namespace std;
 
-void Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims){
+void Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims,int64_t frame){
+  processMulti(I1_,&I2_,1,&D1,&D2,dims,frame);
+}
+
+void Elas::processMulti (uint8_t* I1_,uint8_t** I2_,int32_t n,float** D1s,float** D2s,const int32_t* dims,int64_t frame){
   
   // get width, height and bytes per line
   width  = dims[0];
   height = dims[1];
   bpl    = width + 15-(width-1)%16;
   
-  // copy images to byte aligned memory
-  I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-  I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
-  if (bpl==dims[2]) {
-    memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
-    memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
-  } else {
-    for (int32_t v=0; v<height; v++) {
-      memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
-      memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
-    }
-  }
+  // only use row bounds if they match the current image
+  use_row_bounds = (int32_t)row_disp_min.size()==height;
   
   // allocate memory for disparity grid
   int32_t grid_width   = (int32_t)ceil((float)width/(float)param.grid_size);
@@ -58,92 +52,321 @@ void Elas::process (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t*
 #ifdef PROFILE
   timer.start("Descriptor");  
 #endif
-  Descriptor desc1(I1,width,height,bpl,param.subsampling);
-  Descriptor desc2(I2,width,height,bpl,param.subsampling);
+  // reference descriptor, reused if I1 is the same buffer/frame as in the last call
+  bool cached = frame>=0 && ref_desc && ref_buffer==I1_ && ref_frame==frame && ref_subsampling==param.subsampling &&
+                ref_dims[0]==dims[0] && ref_dims[1]==dims[1] && ref_dims[2]==dims[2];
+  if (!cached) {
+    I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+    if (bpl==dims[2]) {
+      memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
+    } else {
+      for (int32_t v=0; v<height; v++)
+        memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
+    }
+    ref_desc = std::make_shared<Descriptor>(I1,width,height,bpl,param.subsampling);
+    _mm_free(I1);
+    ref_buffer      = frame>=0 ? I1_ : 0;
+    ref_frame       = frame;
+    ref_subsampling = param.subsampling;
+    memcpy(ref_dims,dims,3*sizeof(int32_t));
+  }
+  std::shared_ptr<Descriptor> desc1 = ref_desc;
+  if (frame<0) ref_desc.reset();
 
+  // copy partner images to byte aligned memory
+  I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+
+  for (int32_t i=0; i<n; i++) {
+    float* D1 = D1s[i];
+    float* D2 = D2s[i];
+    if (bpl==dims[2]) {
+      memcpy(I2,I2_[i],bpl*height*sizeof(uint8_t));
+    } else {
+      for (int32_t v=0; v<height; v++)
+        memcpy(I2+v*bpl,I2_[i]+v*dims[2],width*sizeof(uint8_t));
+    }
+    Descriptor desc2(I2,width,height,bpl,param.subsampling);
 #ifdef PROFILE
-  timer.start("Support Matches");
+    timer.start("Support Matches");
 #endif
-  vector<support_pt> p_support = computeSupportMatches(desc1.I_desc,desc2.I_desc);
+    vector<support_pt> p_support = computeSupportMatches(desc1->I_desc,desc2.I_desc);
+    support_points = p_support;
 
 #ifdef PROFILE
-  timer.start("Delaunay Triangulation");
+    timer.start("Delaunay Triangulation");
 #endif
-  vector<triangle> tri_1 = computeDelaunayTriangulation(p_support,0);
-  vector<triangle> tri_2 = computeDelaunayTriangulation(p_support,1);
+    vector<triangle> tri_1 = computeDelaunayTriangulation(p_support,0);
+    vector<triangle> tri_2 = computeDelaunayTriangulation(p_support,1);
 
 #ifdef PROFILE
-  timer.start("Disparity Planes");
+    timer.start("Disparity Planes");
 #endif
-  computeDisparityPlanes(p_support,tri_1,0);
-  computeDisparityPlanes(p_support,tri_2,1);
+    computeDisparityPlanes(p_support,tri_1,0);
+    computeDisparityPlanes(p_support,tri_2,1);
 
 #ifdef PROFILE
-  timer.start("Grid");
+    timer.start("Grid");
 #endif
-  createGrid(p_support,disparity_grid_1,grid_dims,0);
-  createGrid(p_support,disparity_grid_2,grid_dims,1);
+    createGrid(p_support,disparity_grid_1,grid_dims,0);
+    createGrid(p_support,disparity_grid_2,grid_dims,1);
 
 #ifdef PROFILE
-  timer.start("Matching");
+    timer.start("Matching");
 #endif
-  computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1.I_desc,desc2.I_desc,0,D1);
-  computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1.I_desc,desc2.I_desc,1,D2);
+    computeDisparity(p_support,tri_1,disparity_grid_1,grid_dims,desc1->I_desc,desc2.I_desc,0,D1);
+    computeDisparity(p_support,tri_2,disparity_grid_2,grid_dims,desc1->I_desc,desc2.I_desc,1,D2);
 
 #ifdef PROFILE
-  timer.start("L/R Consistency Check");
+    timer.start("L/R Consistency Check");
 #endif
-  leftRightConsistencyCheck(D1,D2);
+    leftRightConsistencyCheck(D1,D2);
 
 #ifdef PROFILE
-  timer.start("Remove Small Segments");
+    timer.start("Remove Small Segments");
 #endif
-  removeSmallSegments(D1);
-  if (!param.postprocess_only_left)
-    removeSmallSegments(D2);
+    removeSmallSegments(D1);
+    if (!param.postprocess_only_left)
+      removeSmallSegments(D2);
+
+#ifdef PROFILE
+    timer.start("Gap Interpolation");
+#endif
+    gapInterpolation(D1);
+    if (!param.postprocess_only_left)
+      gapInterpolation(D2);
+
+    if (param.filter_adaptive_mean) {
+#ifdef PROFILE
+      timer.start("Adaptive Mean");
+#endif
+      adaptiveMean(D1);
+      if (!param.postprocess_only_left)
+        adaptiveMean(D2);
+    }
+
+    if (param.filter_median) {
+#ifdef PROFILE
+      timer.start("Median");
+#endif
+      median(D1);
+      if (!param.postprocess_only_left)
+        median(D2);
+    }
+
+#ifdef PROFILE
+    timer.plot();
+#endif
+  }
+
+  // release memory
+  free(disparity_grid_1);
+  free(disparity_grid_2);
+  _mm_free(I2);
+}
+
+void Elas::processBands (uint8_t* I1_,uint8_t* I2_,float* D1,float* D2,const int32_t* dims,int32_t band_height){
+  
+  // get width, height and bytes per line
+  width  = dims[0];
+  height = dims[1];
+  bpl    = width + 15-(width-1)%16;
+  use_row_bounds = (int32_t)row_disp_min.size()==height;
+  band_height = max(band_height,16);
+  
+  // descriptors of row v need image rows v-3..v+3, matching needs descriptor
+  // rows v-2..v+2, bands start at even rows to keep the subsampling pattern
+  const int32_t halo = 8;
+  uint8_t* I_band = (uint8_t*)_mm_malloc(bpl*(band_height+2*halo+1)*sizeof(uint8_t),16);
+  
+  // candidate disparities (small, one value per candidate)
+  int32_t D_can_stepsize = param.candidate_stepsize;
+  if (param.subsampling)
+    D_can_stepsize += D_can_stepsize%2;
+  int32_t D_can_width  = width/D_can_stepsize;
+  int32_t D_can_height = height/D_can_stepsize;
+  int16_t* D_can = (int16_t*)calloc(D_can_width*D_can_height,sizeof(int16_t));
 
+  // first pass: support point candidates band by band
+#ifdef PROFILE
+  timer.start("Support Matches (bands)");
+#endif
+  for (int32_t v0=0; v0<height; v0+=band_height) {
+    int32_t v1     = min(v0+band_height,height);
+    int32_t v_desc = max(v0-halo,0) & ~1;
+    int32_t h_desc = min(v1+halo,height)-v_desc;
+    copyBand(I1_,dims[2],v_desc,h_desc,I_band);
+    Descriptor desc1(I_band,width,h_desc,bpl,param.subsampling);
+    copyBand(I2_,dims[2],v_desc,h_desc,I_band);
+    Descriptor desc2(I_band,width,h_desc,bpl,param.subsampling);
+    computeCandidateDisparityImage(desc1.I_desc-16*width*v_desc,desc2.I_desc-16*width*v_desc,
+                                   D_can,D_can_width,D_can_height,D_can_stepsize,v0,v1);
+  }
+  vector<support_pt> p_support = extractSupportMatches(D_can,D_can_width,D_can_height,D_can_stepsize);
+  support_points = p_support;
+  free(D_can);
+  
 #ifdef PROFILE
-  timer.start("Gap Interpolation");
+  timer.start("Delaunay Triangulation");
 #endif
+  vector<triangle> tri_1 = computeDelaunayTriangulation(p_support,0);
+  vector<triangle> tri_2 = computeDelaunayTriangulation(p_support,1);
+  computeDisparityPlanes(p_support,tri_1,0);
+  computeDisparityPlanes(p_support,tri_2,1);
+  
+  // init disparity images to -10
+  int32_t D_size = param.subsampling ? (width/2)*(height/2) : width*height;
+  for (int32_t i=0; i<D_size; i++) {
+    *(D1+i) = -10;
+    *(D2+i) = -10;
+  }
+  
+  // grids only for the grid rows of the current band
+  int32_t grid_width   = (int32_t)ceil((float)width/(float)param.grid_size);
+  int32_t grid_height  = (int32_t)ceil((float)height/(float)param.grid_size);
+  int32_t grid_dims[3] = {param.disp_max+2,grid_width,grid_height};
+  int32_t grid_rows    = band_height/param.grid_size+2;
+  int32_t grid_line    = (param.disp_max+2)*grid_width;
+  int32_t* disparity_grid_1 = (int32_t*)malloc(grid_line*grid_rows*sizeof(int32_t));
+  int32_t* disparity_grid_2 = (int32_t*)malloc(grid_line*grid_rows*sizeof(int32_t));
+  
+  // second pass: dense matching band by band
+#ifdef PROFILE
+  timer.start("Matching (bands)");
+#endif
+  for (int32_t v0=0; v0<height; v0+=band_height) {
+    int32_t v1     = min(v0+band_height,height);
+    int32_t v_desc = max(v0-halo,0) & ~1;
+    int32_t h_desc = min(v1+halo,height)-v_desc;
+    int32_t g0     = v0/param.grid_size;
+    int32_t g1     = (v1-1)/param.grid_size+1;
+    
+    // grid and descriptor pointers are shifted, such that they can be
+    // addressed with image coordinates
+    createGrid(p_support,disparity_grid_1-g0*grid_line,grid_dims,0,g0,g1);
+    createGrid(p_support,disparity_grid_2-g0*grid_line,grid_dims,1,g0,g1);
+    copyBand(I1_,dims[2],v_desc,h_desc,I_band);
+    Descriptor desc1(I_band,width,h_desc,bpl,param.subsampling);
+    copyBand(I2_,dims[2],v_desc,h_desc,I_band);
+    Descriptor desc2(I_band,width,h_desc,bpl,param.subsampling);
+    uint8_t* I1_desc = desc1.I_desc-16*width*v_desc;
+    uint8_t* I2_desc = desc2.I_desc-16*width*v_desc;
+    computeDisparity(p_support,tri_1,disparity_grid_1-g0*grid_line,grid_dims,I1_desc,I2_desc,0,D1,v0,v1);
+    computeDisparity(p_support,tri_2,disparity_grid_2-g0*grid_line,grid_dims,I1_desc,I2_desc,1,D2,v0,v1);
+  }
+  free(disparity_grid_1);
+  free(disparity_grid_2);
+  _mm_free(I_band);
+  
+  // postprocessing works on the disparity images only
+#ifdef PROFILE
+  timer.start("Postprocessing");
+#endif
+  leftRightConsistencyCheck(D1,D2);
+  removeSmallSegments(D1);
+  if (!param.postprocess_only_left)
+    removeSmallSegments(D2);
   gapInterpolation(D1);
   if (!param.postprocess_only_left)
     gapInterpolation(D2);
-
   if (param.filter_adaptive_mean) {
-#ifdef PROFILE
-    timer.start("Adaptive Mean");
-#endif
     adaptiveMean(D1);
     if (!param.postprocess_only_left)
       adaptiveMean(D2);
   }
-
   if (param.filter_median) {
-#ifdef PROFILE
-    timer.start("Median");
-#endif
     median(D1);
     if (!param.postprocess_only_left)
       median(D2);
   }
+  
+#ifdef PROFILE
+  timer.plot();
+#endif
+}
+
+void Elas::copyBand (const uint8_t* I,int32_t stride,int32_t v_begin,int32_t rows,uint8_t* I_band) {
+  for (int32_t v=0; v<rows; v++)
+    memcpy(I_band+v*bpl,I+(v_begin+v)*stride,width*sizeof(uint8_t));
+}
+
+void Elas::processSparse (uint8_t* I1_,uint8_t* I2_,const int32_t* dims,vector<support_pt> &p_support,
+                          vector<triangle> &tri,float* D1){
+  
+  // get width, height and bytes per line
+  width  = dims[0];
+  height = dims[1];
+  bpl    = width + 15-(width-1)%16;
+  use_row_bounds = (int32_t)row_disp_min.size()==height;
+  
+  // copy images to byte aligned memory
+  I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+  I2 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
+  if (bpl==dims[2]) {
+    memcpy(I1,I1_,bpl*height*sizeof(uint8_t));
+    memcpy(I2,I2_,bpl*height*sizeof(uint8_t));
+  } else {
+    for (int32_t v=0; v<height; v++) {
+      memcpy(I1+v*bpl,I1_+v*dims[2],width*sizeof(uint8_t));
+      memcpy(I2+v*bpl,I2_+v*dims[2],width*sizeof(uint8_t));
+    }
+  }
+
+#ifdef PROFILE
+  timer.start("Descriptor");  
+#endif
+  Descriptor desc1(I1,width,height,bpl,param.subsampling);
+  Descriptor desc2(I2,width,height,bpl,param.subsampling);
+
+#ifdef PROFILE
+  timer.start("Support Matches");
+#endif
+  p_support = computeSupportMatches(desc1.I_desc,desc2.I_desc);
+  support_points = p_support;
+
+#ifdef PROFILE
+  timer.start("Delaunay Triangulation");
+#endif
+  tri = computeDelaunayTriangulation(p_support,0);
+
+#ifdef PROFILE
+  timer.start("Disparity Planes");
+#endif
+  computeDisparityPlanes(p_support,tri,0);
+
+  if (D1) {
+#ifdef PROFILE
+    timer.start("Rasterize Planes");
+#endif
+    rasterizePlanes(p_support,tri,D1);
+  }
 
 #ifdef PROFILE
   timer.plot();
 #endif
 
   // release memory
-  free(disparity_grid_1);
-  free(disparity_grid_2);
   _mm_free(I1);
   _mm_free(I2);
 }
 
+void Elas::setRowBounds (const int32_t* d_min,const int32_t* d_max,int32_t rows) {
+  row_disp_min.assign(d_min,d_min+rows);
+  row_disp_max.assign(d_max,d_max+rows);
+}
+
+void Elas::clearRowBounds () {
+  row_disp_min.clear();
+  row_disp_max.clear();
+  use_row_bounds = false;
+}
+
 void Elas::supportPointImage (uint8_t* I1_,uint8_t* I2_,const int32_t* dims,int16_t* &D_can,int32_t &D_can_width,int32_t &D_can_height,int32_t &D_can_stepsize){
   
   // get width, height and bytes per line
   width  = dims[0];
   height = dims[1];
   bpl    = width + 15-(width-1)%16;
+  use_row_bounds = (int32_t)row_disp_min.size()==height;
   
   // copy images to byte aligned memory
   I1 = (uint8_t*)_mm_malloc(bpl*height*sizeof(uint8_t),16);
@@ -359,6 +582,12 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
     if (!right_image) disp_max_valid = min(param.disp_max,u-window_size-u_step);
     else              disp_max_valid = min(param.disp_max,width-u-window_size-u_step);
     
+    // restrict search to row bounds (if given)
+    if (use_row_bounds) {
+      disp_min_valid = max(disp_min_valid,row_disp_min[v]);
+      disp_max_valid = min(disp_max_valid,row_disp_max[v]);
+    }
+    
     // assume, that we can compute at least 10 disparities for this pixel
     if (disp_max_valid-disp_min_valid<10)
       return -1;
@@ -404,16 +633,22 @@ inline int16_t Elas::computeMatchingDisparity (const int32_t &u,const int32_t &v
     return -1;
 }
 
-void Elas::computeCandidateDisparityImage(uint8_t* I1_desc,uint8_t* I2_desc,int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize) {
+void Elas::computeCandidateDisparityImage(uint8_t* I1_desc,uint8_t* I2_desc,int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize,
+                                          int32_t v_begin,int32_t v_end) {
 
   // loop variables
   int32_t u,v;
   int16_t d,d2;
+  
+  // candidate rows inside [v_begin,v_end) (whole image by default)
+  if (v_end<0) v_end = height;
+  int32_t v_can_begin = max((v_begin+D_can_stepsize-1)/D_can_stepsize,1);
+  int32_t v_can_end   = min((v_end+D_can_stepsize-1)/D_can_stepsize,D_can_height);
    
   // for all point candidates in image 1 do
   for (int32_t u_can=1; u_can<D_can_width; u_can++) {
     u = u_can*D_can_stepsize;
-    for (int32_t v_can=1; v_can<D_can_height; v_can++) {
+    for (int32_t v_can=v_can_begin; v_can<v_can_end; v_can++) {
       v = v_can*D_can_stepsize;
       
       // initialize disparity candidate to invalid
@@ -448,6 +683,18 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
   // compute sparse disparity image
   computeCandidateDisparityImage(I1_desc,I2_desc,D_can,D_can_width,D_can_height,D_can_stepsize);
   
+  // filter candidates and collect support points
+  vector<support_pt> p_support = extractSupportMatches(D_can,D_can_width,D_can_height,D_can_stepsize);
+
+  // free memory
+  free(D_can);
+  
+  // return support point vector
+  return p_support; 
+}
+
+vector<Elas::support_pt> Elas::extractSupportMatches (int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize) {
+  
   // remove inconsistent support points
   removeInconsistentSupportPoints(D_can,D_can_width,D_can_height);
   
@@ -470,9 +717,6 @@ vector<Elas::support_pt> Elas::computeSupportMatches (uint8_t* I1_desc,uint8_t*
   // with the same disparity as the nearest neighbor support point
   if (param.add_corners)
     addCornerSupportPoints(p_support);
-
-  // free memory
-  free(D_can);
   
   // return support point vector
   return p_support; 
@@ -618,15 +862,23 @@ void Elas::computeDisparityPlanes (vector<support_pt> p_support,vector<triangle>
   }  
 }
 
-void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image) {
+void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image,
+                      int32_t grid_y_begin,int32_t grid_y_end) {
   
   // get grid dimensions
   int32_t grid_width  = grid_dims[1];
   int32_t grid_height = grid_dims[2];
+  if (grid_y_end<0) grid_y_end = grid_height;
+  
+  // the 3x3 diffusion below also wraps around row ends, so two
+  // rows above and below the requested rows are needed
+  int32_t temp_y_begin = max(grid_y_begin-2,0);
+  int32_t temp_y_end   = min(grid_y_end+2,grid_height);
+  int32_t temp_height  = temp_y_end-temp_y_begin;
   
   // allocate temporary memory
-  int32_t* temp1 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
-  int32_t* temp2 = (int32_t*)calloc((param.disp_max+1)*grid_height*grid_width,sizeof(int32_t));
+  int32_t* temp1 = (int32_t*)calloc((param.disp_max+1)*temp_height*grid_width,sizeof(int32_t));
+  int32_t* temp2 = (int32_t*)calloc((param.disp_max+1)*temp_height*grid_width,sizeof(int32_t));
   
   // for all support points do
   for (int32_t i=0; i<p_support.size(); i++) {
@@ -648,34 +900,41 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
       int32_t y = y_curr/param.grid_size;
       
       // point may potentially lay outside (corner points)
-      if (x>=0 && x<grid_width &&y>=0 && y<grid_height) {
-        int32_t addr = getAddressOffsetGrid(x,y,d,grid_width,param.disp_max+1);
+      if (x>=0 && x<grid_width &&y>=temp_y_begin && y<temp_y_end) {
+        int32_t addr = getAddressOffsetGrid(x,y-temp_y_begin,d,grid_width,param.disp_max+1);
         *(temp1+addr) = 1;
       }
     }
   }
   
-  // diffusion pointers
-  const int32_t* tl = temp1 + (0*grid_width+0)*(param.disp_max+1);
-  const int32_t* tc = temp1 + (0*grid_width+1)*(param.disp_max+1);
-  const int32_t* tr = temp1 + (0*grid_width+2)*(param.disp_max+1);
-  const int32_t* cl = temp1 + (1*grid_width+0)*(param.disp_max+1);
-  const int32_t* cc = temp1 + (1*grid_width+1)*(param.disp_max+1);
-  const int32_t* cr = temp1 + (1*grid_width+2)*(param.disp_max+1);
-  const int32_t* bl = temp1 + (2*grid_width+0)*(param.disp_max+1);
-  const int32_t* bc = temp1 + (2*grid_width+1)*(param.disp_max+1);
-  const int32_t* br = temp1 + (2*grid_width+2)*(param.disp_max+1);
+  // cells to diffuse (all except the first and last grid_width+1 cells)
+  int32_t k_begin  = max(grid_y_begin*grid_width,grid_width+1)-temp_y_begin*grid_width;
+  int32_t k_end    = min(grid_y_end*grid_width,grid_width*grid_height-grid_width-1)-temp_y_begin*grid_width;
   
-  int32_t* result    = temp2 + (1*grid_width+1)*(param.disp_max+1); 
-  int32_t* end_input = temp1 + grid_width*grid_height*(param.disp_max+1);
-  
-  // diffuse temporary grid
-  for( ; br != end_input; tl++, tc++, tr++, cl++, cc++, cr++, bl++, bc++, br++, result++ )
-    *result = *tl | *tc | *tr | *cl | *cc | *cr | *bl | *bc | *br;
+  if (k_begin<k_end) {
+    
+    // diffusion pointers
+    const int32_t* tl = temp1 + (k_begin-grid_width-1)*(param.disp_max+1);
+    const int32_t* tc = temp1 + (k_begin-grid_width+0)*(param.disp_max+1);
+    const int32_t* tr = temp1 + (k_begin-grid_width+1)*(param.disp_max+1);
+    const int32_t* cl = temp1 + (k_begin-1)*(param.disp_max+1);
+    const int32_t* cc = temp1 + (k_begin+0)*(param.disp_max+1);
+    const int32_t* cr = temp1 + (k_begin+1)*(param.disp_max+1);
+    const int32_t* bl = temp1 + (k_begin+grid_width-1)*(param.disp_max+1);
+    const int32_t* bc = temp1 + (k_begin+grid_width+0)*(param.disp_max+1);
+    const int32_t* br = temp1 + (k_begin+grid_width+1)*(param.disp_max+1);
+    
+    int32_t* result     = temp2 + k_begin*(param.disp_max+1); 
+    int32_t* end_result = temp2 + k_end*(param.disp_max+1);
+    
+    // diffuse temporary grid
+    for( ; result != end_result; tl++, tc++, tr++, cl++, cc++, cr++, bl++, bc++, br++, result++ )
+      *result = *tl | *tc | *tr | *cl | *cc | *cr | *bl | *bc | *br;
+  }
   
   // for all grid positions create disparity grid
   for (int32_t x=0; x<grid_width; x++) {
-    for (int32_t y=0; y<grid_height; y++) {
+    for (int32_t y=grid_y_begin; y<grid_y_end; y++) {
         
       // start with second value (first is reserved for count)
       int32_t curr_ind = 1;
@@ -684,7 +943,7 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
       for (int32_t d=0; d<=param.disp_max; d++) {
 
         // if yes => add this disparity to current cell
-        if (*(temp2+getAddressOffsetGrid(x,y,d,grid_width,param.disp_max+1))>0) {
+        if (*(temp2+getAddressOffsetGrid(x,y-temp_y_begin,d,grid_width,param.disp_max+1))>0) {
           *(disparity_grid+getAddressOffsetGrid(x,y,curr_ind,grid_width,param.disp_max+2))=d;
           curr_ind++;
         }
@@ -700,6 +959,81 @@ void Elas::createGrid(vector<support_pt> p_support,int32_t* disparity_grid,int32
   free(temp2);
 }
 
+void Elas::rasterizePlanes (const vector<support_pt> &p_support,const vector<triangle> &tri,float* D) {
+  
+  // get disparity image dimensions
+  int32_t D_width  = width;
+  int32_t D_height = height;
+  if (param.subsampling) {
+    D_width  = width/2;
+    D_height = height/2;
+  }
+  
+  // init disparity image to invalid
+  for (int32_t i=0; i<D_width*D_height; i++)
+    *(D+i) = -10;
+  
+  // for all triangles do
+  for (uint32_t i=0; i<tri.size(); i++) {
+    
+    // plane parameters of the left image
+    float plane_a = tri[i].t1a;
+    float plane_b = tri[i].t1b;
+    float plane_c = tri[i].t1c;
+    
+    // sort triangle corners wrt. u (ascending)
+    float tri_u[3] = {(float)p_support[tri[i].c1].u,(float)p_support[tri[i].c2].u,(float)p_support[tri[i].c3].u};
+    float tri_v[3] = {(float)p_support[tri[i].c1].v,(float)p_support[tri[i].c2].v,(float)p_support[tri[i].c3].v};
+    for (uint32_t j=0; j<3; j++) {
+      for (uint32_t k=0; k<j; k++) {
+        if (tri_u[k]>tri_u[j]) {
+          float tri_u_temp = tri_u[j]; tri_u[j] = tri_u[k]; tri_u[k] = tri_u_temp;
+          float tri_v_temp = tri_v[j]; tri_v[j] = tri_v[k]; tri_v[k] = tri_v_temp;
+        }
+      }
+    }
+    
+    // rename corners
+    float A_u = tri_u[0]; float A_v = tri_v[0];
+    float B_u = tri_u[1]; float B_v = tri_v[1];
+    float C_u = tri_u[2]; float C_v = tri_v[2];
+    
+    // compute straight lines connecting triangle corners
+    float AB_a = 0; float AC_a = 0; float BC_a = 0;
+    if ((int32_t)(A_u)!=(int32_t)(B_u)) AB_a = (A_v-B_v)/(A_u-B_u);
+    if ((int32_t)(A_u)!=(int32_t)(C_u)) AC_a = (A_v-C_v)/(A_u-C_u);
+    if ((int32_t)(B_u)!=(int32_t)(C_u)) BC_a = (B_v-C_v)/(B_u-C_u);
+    float AB_b = A_v-AB_a*A_u;
+    float AC_b = A_v-AC_a*A_u;
+    float BC_b = B_v-BC_a*B_u;
+    
+    // fill both parts of the triangle (A->B and B->C)
+    for (int32_t part=0; part<2; part++) {
+      int32_t u_start = part==0 ? (int32_t)A_u : (int32_t)B_u;
+      int32_t u_end   = part==0 ? (int32_t)B_u : (int32_t)C_u;
+      float   line_a  = part==0 ? AB_a : BC_a;
+      float   line_b  = part==0 ? AB_b : BC_b;
+      for (int32_t u=max(u_start,0); u<min(u_end,width); u++) {
+        if (param.subsampling && u%2!=0)
+          continue;
+        int32_t v_1 = (int32_t)(AC_a*(float)u+AC_b);
+        int32_t v_2 = (int32_t)(line_a*(float)u+line_b);
+        int32_t v_start = max(min(v_1,v_2),0);
+        int32_t v_end   = min(max(v_1,v_2),height);
+        
+        // walk down the column, updating the plane incrementally
+        float d = plane_a*(float)u+plane_b*(float)v_start+plane_c;
+        for (int32_t v=v_start; v<v_end; v++, d+=plane_b) {
+          if (!param.subsampling)
+            *(D+getAddressOffsetImage(u,v,D_width)) = max(d,0.0f);
+          else if (v%2==0 && u/2<D_width && v/2<D_height)
+            *(D+getAddressOffsetImage(u/2,v/2,D_width)) = max(d,0.0f);
+        }
+      }
+    }
+  }
+}
+
 inline void Elas::updatePosteriorMinimum(__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
                                          const __m128i &xmm1,__m128i &xmm2,int32_t &val,int32_t &min_val,int32_t &min_d) {
   xmm2 = _mm_load_si128(I2_block_addr);
@@ -760,10 +1094,19 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
   if (sum<param.match_texture)
     return;
 
+  // get valid disparity range of this row
+  int32_t d_row_min = max(param.disp_min,0);
+  int32_t d_row_max = disp_num-1;
+  if (use_row_bounds) {
+    int32_t v_row = max(min(v,height-1),0);
+    d_row_min = max(row_disp_min[v_row],d_row_min);
+    d_row_max = min(row_disp_max[v_row],disp_num-1);
+  }
+
   // compute disparity, min disparity and max disparity of plane prior
   int32_t d_plane     = (int32_t)(plane_a*(float)u+plane_b*(float)v+plane_c);
-  int32_t d_plane_min = max(d_plane-plane_radius,0);
-  int32_t d_plane_max = min(d_plane+plane_radius,disp_num-1);
+  int32_t d_plane_min = max(d_plane-plane_radius,d_row_min);
+  int32_t d_plane_max = min(d_plane+plane_radius,d_row_max);
 
   // get grid pointer
   int32_t  grid_x    = (int32_t)floor((float)u/(float)param.grid_size);
@@ -783,6 +1126,8 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
   if (!right_image) { 
     for (int32_t i=0; i<num_grid; i++) {
       d_curr = d_grid[i];
+      if (d_curr<d_row_min || d_curr>d_row_max)
+        continue;
       if (d_curr<d_plane_min || d_curr>d_plane_max) {
         u_warp = u-d_curr;
         if (u_warp<window_size || u_warp>width-window_size-1)
@@ -801,6 +1146,8 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
   } else {
     for (int32_t i=0; i<num_grid; i++) {
       d_curr = d_grid[i];
+      if (d_curr<d_row_min || d_curr>d_row_max)
+        continue;
       if (d_curr<d_plane_min || d_curr>d_plane_max) {
         u_warp = u+d_curr;
         if (u_warp<window_size || u_warp>width-window_size-1)
@@ -823,7 +1170,7 @@ inline void Elas::findMatch(int32_t &u,int32_t &v,float &plane_a,float &plane_b,
 
 // TODO: %2 => more elegantly
 void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,int32_t* disparity_grid,int32_t *grid_dims,
-                            uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D) {
+                            uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D,int32_t v_begin,int32_t v_end) {
 
   // number of disparities
   const int32_t disp_num  = grid_dims[0]-1;
@@ -831,13 +1178,17 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
   // descriptor window_size
   int32_t window_size = 2;
   
-  // init disparity image to -10
-  if (param.subsampling) {
-    for (int32_t i=0; i<(width/2)*(height/2); i++)
-      *(D+i) = -10;
-  } else {
-    for (int32_t i=0; i<width*height; i++)
-      *(D+i) = -10;
+  // init disparity image to -10 (only when computing the whole image, bands
+  // are initialized by the caller)
+  if (v_end<0) {
+    v_end = height;
+    if (param.subsampling) {
+      for (int32_t i=0; i<(width/2)*(height/2); i++)
+        *(D+i) = -10;
+    } else {
+      for (int32_t i=0; i<width*height; i++)
+        *(D+i) = -10;
+    }
   }
   
   // pre-compute prior 
@@ -919,7 +1270,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
       if (!param.subsampling || u%2==0) {
         int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
         int32_t v_2 = (uint32_t)(AB_a*(float)u+AB_b);
-        for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++) {
+        for (int32_t v=max(min(v_1,v_2),v_begin); v<min(max(v_1,v_2),v_end); v++) {
           if (!param.subsampling || v%2==0) {
             findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
                       I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
@@ -933,7 +1284,7 @@ void Elas::computeDisparity(vector<support_pt> p_support,vector<triangle> tri,in
       if (!param.subsampling || u%2==0) {
         int32_t v_1 = (uint32_t)(AC_a*(float)u+AC_b);
         int32_t v_2 = (uint32_t)(BC_a*(float)u+BC_b);
-        for (int32_t v=min(v_1,v_2); v<max(v_1,v_2); v++) {
+        for (int32_t v=max(min(v_1,v_2),v_begin); v<min(max(v_1,v_2),v_end); v++) {
           if (!param.subsampling || v%2==0) {
             findMatch(u,v,plane_a,plane_b,plane_c,disparity_grid,grid_dims,
                       I1_desc,I2_desc,P,plane_radius,valid,right_image,D);
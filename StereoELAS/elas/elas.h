@@ -29,6 +29,7 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #include <string.h>
 #include <stdlib.h>
 #include <vector>
+#include <memory>
 #include <emmintrin.h>
 
 // define fixed-width datatypes for Visual Studio projects
@@ -49,6 +50,8 @@ Street, Fifth Floor, Boston, MA 02110-1301, USA
 #include "timer.h"
 #endif
 
+class Descriptor;
+
 class Elas {
   
 public:
@@ -144,8 +147,25 @@ public:
     }
   };
 
+  // support point (u,v in left image coordinates, d = disparity)
+  struct support_pt {
+    int32_t u;
+    int32_t v;
+    int32_t d;
+    support_pt(int32_t u,int32_t v,int32_t d):u(u),v(v),d(d){}
+  };
+
+  // triangle (corner indices into support points and plane parameters
+  // d = t*a*u + t*b*v + t*c for left (t1) and right (t2) image)
+  struct triangle {
+    int32_t c1,c2,c3;
+    float   t1a,t1b,t1c;
+    float   t2a,t2b,t2c;
+    triangle(int32_t c1,int32_t c2,int32_t c3):c1(c1),c2(c2),c3(c3){}
+  };
+
   // constructor, input: parameters  
-  Elas (parameters param) : param(param) {}
+  Elas (parameters param) : param(param),use_row_bounds(false),ref_buffer(0),ref_frame(-1),ref_subsampling(false) {}
 
   // deconstructor
   ~Elas () {}
@@ -159,27 +179,54 @@ public:
   //         note: D1 and D2 must be allocated before (bytes per line = width)
   //               if subsampling is not active their size is width x height,
   //               otherwise width/2 x height/2 (rounded towards zero)
-  void process (uint8_t* I1,uint8_t* I2,float* D1,float* D2,const int32_t* dims);
+  //         frame = frame number of I1, if >= 0 the descriptor of I1 is cached and
+  //                 reused by following calls with the same I1 buffer, frame and dims
+  void process (uint8_t* I1,uint8_t* I2,float* D1,float* D2,const int32_t* dims,int64_t frame=-1);
+
+  // multi-baseline matching: matches the reference image I1 against n partner
+  // images I2[0..n-1], the descriptor of I1 is computed only once
+  // inputs: I2[i], D1[i], D2[i] as I2, D1, D2 in process() for partner i
+  //         dims, frame: see process(), all partners have the size of I1
+  //         note: getSupportPoints() returns the support points of the last partner
+  void processMulti (uint8_t* I1,uint8_t** I2,int32_t n,float** D1,float** D2,const int32_t* dims,int64_t frame=-1);
   
+  // band-streaming matching function for very large images, same result as process()
+  // but only band_height image rows (plus a small halo) of aligned images,
+  // descriptors and disparity grids are held in memory at a time. descriptors
+  // are computed twice (support points need the whole image before matching)
+  // inputs: see process(), band_height = number of rows per band (>= 16)
+  void processBands (uint8_t* I1,uint8_t* I2,float* D1,float* D2,const int32_t* dims,int32_t band_height);
+
+  // sparse matching function: support points, triangulation and disparity planes only
+  // inputs: pointers to left (I1) and right (I2) intensity image (uint8, input)
+  //         dims: see process()
+  //         pointer to left disparity image (D1, float, optional output), if given
+  //         the piecewise planar disparity of all triangles is rasterized into it
+  //         (size conventions as in process(), uncovered pixels are set to -10)
+  // outputs: support points and triangles (with plane parameters) of the left image
+  void processSparse (uint8_t* I1,uint8_t* I2,const int32_t* dims,std::vector<support_pt> &p_support,
+                      std::vector<triangle> &tri,float* D1=0);
+
+  // get/set parameters, changes take effect with the next call of process()
+  parameters getParameters () const { return param; }
+  void setParameters (parameters param) { this->param = param; }
+
+  // support points found by the last call of process()
+  const std::vector<support_pt>& getSupportPoints () const { return support_points; }
+
+  // optional per-row disparity search bounds (e.g. from a ground plane prior)
+  // inputs: pointers to lower (d_min) and upper (d_max) disparity per row
+  //         rows = number of rows, must equal dims[1] passed to process(),
+  //                otherwise the bounds are ignored
+  //         note: bounds stay active until clearRowBounds() is called
+  void setRowBounds (const int32_t* d_min,const int32_t* d_max,int32_t rows);
+  void clearRowBounds ();
+
   // utility function for testing CUDA developments
   void supportPointImage (uint8_t* I1,uint8_t* I2,const int32_t* dims,int16_t* &D_can,int32_t &D_can_width,int32_t &D_can_height,int32_t &D_can_stepsize);
   
 private:
   
-  struct support_pt {
-    int32_t u;
-    int32_t v;
-    int32_t d;
-    support_pt(int32_t u,int32_t v,int32_t d):u(u),v(v),d(d){}
-  };
-
-  struct triangle {
-    int32_t c1,c2,c3;
-    float   t1a,t1b,t1c;
-    float   t2a,t2b,t2c;
-    triangle(int32_t c1,int32_t c2,int32_t c3):c1(c1),c2(c2),c3(c3){}
-  };
-
   inline uint32_t getAddressOffsetImage (const int32_t& u,const int32_t& v,const int32_t& width) {
     return v*width+u;
   }
@@ -194,13 +241,20 @@ private:
                                      int32_t redun_max_dist, int32_t redun_threshold, bool vertical);
   void addCornerSupportPoints (std::vector<support_pt> &p_support);
   inline int16_t computeMatchingDisparity (const int32_t &u,const int32_t &v,uint8_t* I1_desc,uint8_t* I2_desc,const bool &right_image);
-  void computeCandidateDisparityImage(uint8_t* I1_desc,uint8_t* I2_desc,int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize);
+  void computeCandidateDisparityImage(uint8_t* I1_desc,uint8_t* I2_desc,int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize,
+                                      int32_t v_begin=0,int32_t v_end=-1);
   std::vector<support_pt> computeSupportMatches (uint8_t* I1_desc,uint8_t* I2_desc);
+  std::vector<support_pt> extractSupportMatches (int16_t* D_can,int32_t D_can_width,int32_t D_can_height,int32_t D_can_stepsize);
 
   // triangulation & grid
   std::vector<triangle> computeDelaunayTriangulation (std::vector<support_pt> p_support,int32_t right_image);
   void computeDisparityPlanes (std::vector<support_pt> p_support,std::vector<triangle> &tri,int32_t right_image);
-  void createGrid (std::vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image);
+  void createGrid (std::vector<support_pt> p_support,int32_t* disparity_grid,int32_t* grid_dims,bool right_image,
+                   int32_t grid_y_begin=0,int32_t grid_y_end=-1);
+  void rasterizePlanes (const std::vector<support_pt> &p_support,const std::vector<triangle> &tri,float* D);
+
+  // copy rows [v_begin,v_begin+rows) of an image with the given stride to aligned band memory (bpl)
+  void copyBand (const uint8_t* I,int32_t stride,int32_t v_begin,int32_t rows,uint8_t* I_band);
 
   // matching
   inline void updatePosteriorMinimum (__m128i* I2_block_addr,const int32_t &d,const int32_t &w,
@@ -211,7 +265,7 @@ private:
                          int32_t* disparity_grid,int32_t *grid_dims,uint8_t* I1_desc,uint8_t* I2_desc,
                          int32_t *P,int32_t &plane_radius,bool &valid,bool &right_image,float* D);
   void computeDisparity (std::vector<support_pt> p_support,std::vector<triangle> tri,int32_t* disparity_grid,int32_t* grid_dims,
-                         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D);
+                         uint8_t* I1_desc,uint8_t* I2_desc,bool right_image,float* D,int32_t v_begin=0,int32_t v_end=-1);
 
   // L/R consistency check
   void leftRightConsistencyCheck (float* D1,float* D2);
@@ -230,6 +284,20 @@ private:
   // memory aligned input images + dimensions
   uint8_t *I1,*I2;
   int32_t width,height,bpl;
+
+  // support points of the last processed image pair
+  std::vector<support_pt> support_points;
+
+  // optional per-row disparity bounds
+  std::vector<int32_t> row_disp_min,row_disp_max;
+  bool use_row_bounds;
+
+  // cached descriptor of the reference image, identified by buffer, frame and layout
+  std::shared_ptr<Descriptor> ref_desc;
+  const uint8_t* ref_buffer;
+  int64_t ref_frame;
+  int32_t ref_dims[3];
+  bool ref_subsampling;
   
   // profiling timer
 #ifdef PROFILE
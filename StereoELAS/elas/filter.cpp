@@ -442,4 +442,104 @@ namespace filter {
     }
     _mm_free( integral );
   }
+
+  void upsample_guided( const float* D_sub, const uint8_t* I, int bpl, float* D, int w, int h, float sigma ) {
+
+    const int ws = w/2;
+    const int hs = h/2;
+    if (ws<1 || hs<1) return;
+
+    // rows are processed in blocks of 4 output pixels, pad samples and guide
+    // by replicating the border so the unaligned loads never leave the buffers
+    const int wr = (w+3)&~3;
+    const int wp = ((wr/2+8)+3)&~3;
+    float*   Dp   = (float*)_mm_malloc(hs*wp*sizeof(float),16);
+    float*   Gp   = (float*)_mm_malloc(hs*wp*sizeof(float),16);
+    uint8_t* Irow = (uint8_t*)_mm_malloc((wr+4)*sizeof(uint8_t),16);
+    float*   Drow = (float*)_mm_malloc(wr*sizeof(float),16);
+    for (int j=0; j<hs; j++) {
+      const uint8_t* I_line = I+2*j*bpl;
+      for (int i=0; i<wp; i++) {
+        int ic = i<ws ? i : ws-1;
+        Dp[j*wp+i] = D_sub[j*ws+ic];
+        Gp[j*wp+i] = I_line[2*ic];
+      }
+    }
+
+    const __m128 zero    = _mm_setzero_ps();
+    const __m128 one     = _mm_set1_ps(1.0f);
+    const __m128 invalid = _mm_set1_ps(-10.0f);
+    const __m128 big     = _mm_set1_ps(1e9f);
+    const __m128 spread  = _mm_set1_ps(2.0f);
+    const __m128 k       = _mm_set1_ps(1.0f/(sigma*sigma));
+    const __m128 wA      = _mm_setr_ps(1.0f,0.5f,1.0f,0.5f);
+    const __m128 wB      = _mm_setr_ps(0.0f,0.5f,0.0f,0.5f);
+    const __m128i zeroi  = _mm_setzero_si128();
+
+    for (int y=0; y<h; y++) {
+
+      int j0 = y/2<hs ? y/2 : hs-1;
+      int j1 = j0+1<hs ? j0+1 : hs-1;
+      const float fy = (y&1) ? 0.5f : 0.0f;
+      const __m128 wy0 = _mm_set1_ps(1.0f-fy);
+      const __m128 wy1 = _mm_set1_ps(fy);
+      const float* D0 = Dp+j0*wp; const float* G0 = Gp+j0*wp;
+      const float* D1 = Dp+j1*wp; const float* G1 = Gp+j1*wp;
+      memcpy(Irow,I+y*bpl,w*sizeof(uint8_t));
+      memset(Irow+w,Irow[w-1],(wr+4-w)*sizeof(uint8_t));
+
+      for (int x=0; x<wr; x+=4) {
+        const int i = x/2;
+
+        // guide intensities of the 4 output pixels
+        __m128i g8 = _mm_cvtsi32_si128(*(const int32_t*)(Irow+x));
+        __m128  g  = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(g8,zeroi),zeroi));
+
+        // neighbouring samples: A = (s_i,s_i,s_i+1,s_i+1), B = (s_i,s_i+1,s_i+1,s_i+2)
+        __m128 sum   = zero;
+        __m128 sumw  = zero;
+        __m128 bestw = zero;
+        __m128 bestd = invalid;
+        __m128 dmin  = big;
+        __m128 dmax  = invalid;
+        for (int r=0; r<2; r++) {
+          const float* Dr = r ? D1 : D0;
+          const float* Gr = r ? G1 : G0;
+          const __m128 wy = r ? wy1 : wy0;
+          __m128 d0 = _mm_loadu_ps(Dr+i), d1 = _mm_loadu_ps(Dr+i+1);
+          __m128 g0 = _mm_loadu_ps(Gr+i), g1 = _mm_loadu_ps(Gr+i+1);
+          for (int c=0; c<2; c++) {
+            __m128 d  = c ? _mm_unpacklo_ps(d0,d1) : _mm_unpacklo_ps(d0,d0);
+            __m128 gs = c ? _mm_unpacklo_ps(g0,g1) : _mm_unpacklo_ps(g0,g0);
+            __m128 dg = _mm_sub_ps(g,gs);
+            __m128 wi = _mm_rcp_ps(_mm_add_ps(one,_mm_mul_ps(_mm_mul_ps(dg,dg),k)));
+            __m128 wt = _mm_mul_ps(_mm_mul_ps(c ? wB : wA,wy),wi);
+            __m128 ok = _mm_and_ps(_mm_cmpge_ps(d,zero),_mm_cmpgt_ps(wt,zero));
+            wt   = _mm_and_ps(wt,ok);
+            sum  = _mm_add_ps(sum,_mm_mul_ps(wt,d));
+            sumw = _mm_add_ps(sumw,wt);
+            __m128 better = _mm_cmpgt_ps(wt,bestw);
+            bestw = _mm_max_ps(bestw,wt);
+            bestd = _mm_or_ps(_mm_and_ps(better,d),_mm_andnot_ps(better,bestd));
+            dmin  = _mm_min_ps(dmin,_mm_or_ps(_mm_and_ps(ok,d),_mm_andnot_ps(ok,big)));
+            dmax  = _mm_max_ps(dmax,_mm_or_ps(_mm_and_ps(ok,d),_mm_andnot_ps(ok,invalid)));
+          }
+        }
+
+        // blend only consistent samples, otherwise (depth edges, outliers)
+        // take the most similar one instead of inventing intermediate depths
+        __m128 valid = _mm_cmpgt_ps(sumw,zero);
+        __m128 blend = _mm_cmple_ps(_mm_sub_ps(dmax,dmin),spread);
+        __m128 res   = _mm_div_ps(sum,_mm_or_ps(sumw,_mm_andnot_ps(valid,one)));
+        res = _mm_or_ps(_mm_and_ps(blend,res),_mm_andnot_ps(blend,bestd));
+        _mm_store_ps(Drow+x,_mm_or_ps(_mm_and_ps(valid,res),_mm_andnot_ps(valid,invalid)));
+      }
+      memcpy(D+y*w,Drow,w*sizeof(float));
+    }
+
+    _mm_free(Dp);
+    _mm_free(Gp);
+    _mm_free(Irow);
+    _mm_free(Drow);
+  }
 }
@@ -94,6 +94,15 @@ namespace filter {
   // -1  1  1  1 -1
   // -1 -1 -1 -1 -1
   void blob5x5( const uint8_t* in, int16_t* out, int w, int h );
+
+  // upsample a disparity map computed with subsampling (pixel (2u,2v) stored
+  // at (u,v), size w/2 x h/2) to w x h. each output pixel is a joint bilateral
+  // blend of its (up to) four neighbouring samples: bilinear spatial weights
+  // times 1/(1+(I(p)-I(q))^2/sigma^2) with the guide image I, invalid (<0)
+  // samples are ignored. if the valid samples differ by more than 2, the one
+  // with the highest weight is taken instead. pixels without any valid sample
+  // are set to -10.
+  void upsample_guided( const float* D_sub, const uint8_t* I, int bpl, float* D, int w, int h, float sigma );
 }
 
 #endif
@@ -11,15 +11,22 @@ WebStreamer::WebStreamer(BVS::ModuleInfo info, const BVS::Info& bvs)
 	, info(info)
 	, logger(info.id)
 	, bvs(bvs)
-	, input("input", BVS::ConnectorType::INPUT)
-	//, output("outputName", BVS::ConnectorType::OUTPUT)
-	, mjpeg(80, 95)
+	, streams()
+	, inputs()
+	, warned()
+	, mjpeg(bvs.config.getValue<int>(info.conf+".port", 80),
+			bvs.config.getValue<int>(info.conf+".quality", 95),
+			bvs.config.getValue<int>(info.conf+".serverThreads", 4),
+			bvs.config.getValue<int>(info.conf+".encoderThreads", 2))
 	, tmp()
-
-	// CONFIGURATION RETRIEVAL
-	//, yourSwitch(bvs.config.getValue<bool>(info.conf + ".yourSwitch", false))
 {
+	bvs.config.getValue<std::string>(info.conf+".streams", streams);
 
+	// without named streams, serve the single 'input' at /mjpeg/
+	if (streams.empty()) inputs.push_back(new BVS::Connector<cv::Mat>("input", BVS::ConnectorType::INPUT));
+	for (auto& name: streams) inputs.push_back(new BVS::Connector<cv::Mat>(name, BVS::ConnectorType::INPUT));
+	if (streams.empty()) streams.push_back("");
+	warned.resize(streams.size(), false);
 }
 
 
@@ -27,7 +34,7 @@ WebStreamer::WebStreamer(BVS::ModuleInfo info, const BVS::Info& bvs)
 // This is your module's destructor.
 WebStreamer::~WebStreamer()
 {
-
+	for (auto& in: inputs) delete in;
 }
 
 
@@ -35,14 +42,28 @@ WebStreamer::~WebStreamer()
 // Put all your work here.
 BVS::Status WebStreamer::execute()
 {
-	if (!input.receive(tmp)) return BVS::Status::NOINPUT;
-	if (tmp.empty()) return BVS::Status::NOINPUT;
-	
-	input.lockConnection();
-	mjpeg.add(tmp);
-	input.unlockConnection();
-
-	return BVS::Status::OK;
+	int received = 0;
+	for (size_t i=0; i<inputs.size(); i++) {
+		if (!inputs.at(i)->receive(tmp)) continue;
+		if (tmp.empty()) continue;
+		received++;
+
+		if (tmp.depth()!=CV_8U || (tmp.channels()!=1 && tmp.channels()!=3)) {
+			if (!warned.at(i)) LOG(1, "Stream '" << streams.at(i) << "' needs 8 bit grey or BGR images!");
+			warned.at(i) = true;
+			continue;
+		}
+
+		// nobody is watching, neither copy nor encode (the normal case)
+		if (!mjpeg.hasClients(streams.at(i))) continue;
+
+		// unchanged frames are detected and skipped by add()
+		inputs.at(i)->lockConnection();
+		mjpeg.add(tmp, streams.at(i));
+		inputs.at(i)->unlockConnection();
+	}
+
+	return received ? BVS::Status::OK : BVS::Status::NOINPUT;
 }
 
 
@@ -3,14 +3,23 @@
 
 #include "bvs/module.h"
 #include "opencv2/opencv.hpp"
+#include <string>
+#include <vector>
 
 // Many thanks to Manel.
 #include "mjpeg.hpp"
 
 
 /** This is the WebStreamer module.
- * Please add sufficient documentation to enable others to use it.
- * Include information about: Dependencies, Inputs, Outputs, Configuration Options...
+ * Serves its inputs as MJPEG streams to browsers. All streams share one
+ * HTTP server and one JPEG encoder pool. Frames are only copied and encoded
+ * while somebody watches their stream.
+ *
+ * Requires: OpenCV, TurboJPEG, boost::asio
+ * Inputs: one cv::Mat input per configured stream (8 bit grey or BGR),
+ *         named like the stream, or 'input' if no streams are configured
+ * Outputs: none
+ * Configuration Options: see WebStreamer.conf
  */
 class WebStreamer : public BVS::Module
 {
@@ -44,14 +53,12 @@ class WebStreamer : public BVS::Module
 		BVS::Logger logger; /**< Your logger instance. @see Logger */
 		const BVS::Info& bvs; /**< Your Info reference. @see Info */
 
-		/** Example Connector used to retrieve/send data from/to other modules.
-		 * @see Connector
-		 */
-		BVS::Connector<cv::Mat> input;
-		//BVS::Connector<std::string> output;
+		std::vector<std::string> streams; /**< Stream names, served at /mjpeg/<name>. */
+		std::vector<BVS::Connector<cv::Mat>*> inputs; /**< Input per stream. */
+		std::vector<bool> warned; /**< Unsupported image type was reported per stream. */
 
-		MJPEG mjpeg;
-		cv::Mat tmp;
+		MJPEG mjpeg; /**< Server and encoder pool shared by all streams. */
+		cv::Mat tmp; /**< Received frame. */
 
 		WebStreamer(const WebStreamer&) = delete; /**< -Weffc++ */
 		WebStreamer& operator=(const WebStreamer&) = delete; /**< -Weffc++ */
@@ -6,74 +6,227 @@
 // license: LGPLv3
 
 #include "uhttp.hpp"
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <condition_variable>
 //#include <uJpeg.hpp>
 #include <turbojpeg.h>
 #include <opencv/cv.h>
 
 class MJPEG : public UHTTP {
 
+	struct Stream {
+		uint64_t frame = 0, sent = 0;                    // sequence numbers of the latest and the last sent frame
+		uint64_t hash = 0;                                // content hash of the latest encoded frame, 0 if none
+		bool listed = false;                              // fed by the producer, shown on the index page
+		std::shared_ptr<const std::string> part;          // last sent multipart chunk, shared by all clients
+		std::vector<std::weak_ptr<Connection>> clients;
+	};
+
+	struct Job {
+		std::string name;
+		uint64_t frame;
+		cv::Mat img;
+	};
+
 	int q;
-	std::map<std::string, uint64_t> timestamps;
-	std::map<std::string, std::shared_future<std::string>> jpegs;
-	
-	static std::string getJPEG( cv::Mat3b img, int quality ) {
-		
+	std::map<std::string, Stream> streams; // guarded by mtx
+
+	// encoder pool, frames are encoded as soon as they are added, a queued frame is replaced by a newer one of its stream
+	std::deque<Job> jobs; // guarded by mtx
+	std::condition_variable work;
+	bool exiting = false;
+	std::vector<std::thread> encoders;
+
+	// FNV style hash over all pixels, much cheaper than copying and encoding the frame
+	static uint64_t getHash( const cv::Mat &img ) {
+
+		uint64_t h = 14695981039346656037ULL ^ (uint64_t(img.rows) << 32 | img.cols);
+		size_t bytes = img.cols * img.elemSize();
+		for (int y=0; y<img.rows; y++) {
+			const uint8_t *row = img.ptr<uint8_t>(y);
+			size_t x = 0;
+			for (; x+8<=bytes; x+=8) { uint64_t w; std::memcpy(&w, row+x, 8); h = (h ^ w) * 1099511628211ULL; }
+			for (; x<bytes; x++) h = (h ^ row[x]) * 1099511628211ULL;
+		}
+		return h ? h : 1;
+	}
+
+	// removes hung up clients, mtx held
+	static bool hasClients( Stream &s ) {
+
+		s.clients.erase(std::remove_if(s.clients.begin(), s.clients.end(), [](std::weak_ptr<Connection> &w){
+
+			auto c = w.lock();
+			return not c or not c->isOpen();
+		}), s.clients.end());
+		return not s.clients.empty();
+	}
+
+	// the multipart chunk is built once per frame and shared by all clients
+	static std::shared_ptr<const std::string> getPart( const unsigned char *jpeg, size_t size ) {
+
+		std::string header = "--myboundary\r\nContent-Length: " + std::to_string(size) + "\r\nContent-Type: image/jpeg\r\n\r\n";
+		auto part = std::make_shared<std::string>();
+		part->reserve(header.size() + size + 4);
+		part->append(header).append((const char *)jpeg, size).append("\r\n\r\n");
+		return part;
+	}
+
+	// encoder thread, owns its compressor and output buffer for its lifetime
+	void encode() {
+
 		tjhandle jpegHandle = tjInitCompress();
-		uint8_t *jpegBuff = NULL;
-		long unsigned int jpegSz = 0;
+		std::vector<unsigned char> jpegBuff;
 
-		tjCompress2(jpegHandle, &img(0,0)[0], img.cols, 0, img.rows, TJPF_BGR, &jpegBuff, &jpegSz, TJSAMP_420, quality, TJFLAG_FASTUPSAMPLE );
-		std::string r((const char *)jpegBuff, size_t(jpegSz));
+		while (true) {
+
+			std::unique_lock<std::mutex> l(mtx);
+			work.wait(l, [&](){ return exiting or not jobs.empty(); });
+			if (exiting) break;
+			Job job = std::move(jobs.front());
+			jobs.pop_front();
+			l.unlock();
+
+			// with TJFLAG_NOREALLOC TurboJPEG writes into our buffer, sized for the worst case
+			bool grey = job.img.channels()==1;
+			int samp = grey ? TJSAMP_GRAY : TJSAMP_420;
+			jpegBuff.resize(std::max<size_t>(jpegBuff.size(), tjBufSize(job.img.cols, job.img.rows, samp)));
+			unsigned char *out = jpegBuff.data();
+			long unsigned int jpegSz = jpegBuff.size();
+			if (tjCompress2(jpegHandle, job.img.data, job.img.cols, job.img.step, job.img.rows, grey ? TJPF_GRAY : TJPF_BGR, &out, &jpegSz, samp, q, TJFLAG_FASTUPSAMPLE | TJFLAG_NOREALLOC )) {
+
+				// nothing was sent, so the same frame must not be skipped next time
+				Lock l(mtx);
+				Stream &s = streams[job.name];
+				if (s.frame==job.frame) s.hash = 0;
+				continue;
+			}
+
+			publish(job.name, job.frame, getPart(out, jpegSz));
+		}
 
-		tjFree(jpegBuff);
 		tjDestroy(jpegHandle);
-		return r;	
 	}
-	
+
+	// sends an encoded frame to all clients of its stream
+	void publish( const std::string &name, uint64_t frame, std::shared_ptr<const std::string> part ) {
+
+		Lock l(mtx);
+		Stream &s = streams[name];
+		if (frame<=s.sent) return; // a newer frame was sent meanwhile
+		s.sent = frame;
+		s.part = part;
+		auto it = std::remove_if(s.clients.begin(), s.clients.end(), [&](std::weak_ptr<Connection> &w){
+
+			auto c = w.lock();
+			return not c or not c->send(part, true);
+		});
+		s.clients.erase(it, s.clients.end());
+	}
+
 public:
 
-	MJPEG(int port = 80, int q = 75, int nworkers = 16) : UHTTP(port, nworkers), q(q) {
-		
-		(*this)("mjpeg", [&](boost::asio::ip::tcp::iostream &net, std::string , std::string url , std::string ) {
-		
+	MJPEG(int port = 80, int q = 75, int nworkers = 4, int nencoders = 2) : UHTTP(port, nworkers), q(q) {
+
+		(*this)("mjpeg", [this](std::shared_ptr<Connection> c, std::string , std::string url , std::string ) {
+
 			std::replace(url.begin(), url.end(),'/',' ');
 			std::istringstream iss(url);
 			std::string command, name;
 			iss >> command >> name;
-		
-			net << "HTTP/1.1 200 OK\r\n";
-			net << "Content-Type: multipart/x-mixed-replace; boundary=myboundary\r\n\r\n";
-			uint64_t old = 0;
-			while (net << "--myboundary\r\n") {
-				
-				while (old==timestamps[name]) std::this_thread::sleep_for( std::chrono::milliseconds(5) );
-				std::shared_future<std::string> j;
-				{ Lock l(mtx); old = timestamps[name]; j = jpegs[name]; }
-				
-				std::string msg = j.get();
-				net << "Content-Length: " << msg.size() << "\r\n";
-				net << "Content-Type: image/jpeg\r\n\r\n";
-				net << msg << "\r\n\r\n";
-				net << std::flush;
+
+			c->send("HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=myboundary\r\n\r\n");
+
+			// streams the producer never fed are only kept while somebody watches them, so requests
+			// for arbitrary names do not pile up
+			Lock l(mtx);
+			for (auto it = streams.begin(); it != streams.end(); ) {
+				if (not it->second.listed and not hasClients(it->second)) it = streams.erase(it);
+				else ++it;
 			}
+
+			// start with the latest encoded frame
+			auto it = streams.find(name);
+			if (it == streams.end()) it = streams.emplace(name, Stream()).first;
+			Stream &s = it->second;
+			s.clients.push_back(c);
+			if (s.part) c->send(s.part, true);
 		});
-		
-		(*this)("", [](boost::asio::ip::tcp::iostream &net, std::string , std::string , std::string ) {
-		
-			net << "HTTP/1.1 200 OK\r\n";
-			net << "Content-Type: text/html\r\n\r\n";
-			net << "<html><body style='background:#000000 no-repeat center center url(/mjpeg/);background-size:contain;'></body></html>";
-			net << "\r\n\r\n";
+
+		// a single unnamed stream fills the page, named streams are listed
+		(*this)("", [this](std::shared_ptr<Connection> c, std::string , std::string , std::string ) {
+
+			std::vector<std::string> names;
+			{ Lock l(mtx); for (auto &s : streams) if (s.second.listed and not s.first.empty()) names.push_back(s.first); }
+
+			std::string html = "<html><body style='background:#000000 no-repeat center center url(/mjpeg/);background-size:contain;'></body></html>";
+			if (not names.empty()) {
+				html = "<html><head><title>streams</title></head><body style='background:#000000;color:#ffffff;font-family:sans-serif;'>";
+				for (auto &name : names)
+					html += "<div style='display:inline-block;margin:4px;'><a style='color:#ffffff;' href='/mjpeg/" + name + "'>" + name + "</a><br>"
+						"<img src='/mjpeg/" + name + "' style='max-width:48vw;max-height:45vh;'></div>";
+				html += "</body></html>";
+			}
+			c->send("HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " + std::to_string(html.size()) + "\r\n\r\n" + html);
+			c->finish();
 		});
+
+		for (int i=0; i<std::max(nencoders, 1); i++)
+			encoders.emplace_back(&MJPEG::encode, this);
 	}
 
-	void add( cv::Mat3b img, std::string name = "" ) {
-		
+	~MJPEG() {
+
+		{ Lock l(mtx); exiting = true; }
+		work.notify_all();
+		for (auto &e : encoders) e.join();
+		stop();
+	}
+
+	// whether a stream has viewers, frames of streams without viewers are dropped by add()
+	bool hasClients( std::string name = "" ) {
+
+		Lock l(mtx);
+		streams[name].listed = true;
+		return hasClients(streams[name]);
+	}
+
+	// copies the frame (8 bit grey or BGR) and hands it to the encoder pool, returns immediately. Frames
+	// nobody watches and frames identical to the last encoded one are neither copied nor encoded, then
+	// false is returned.
+	bool add( cv::Mat img, std::string name = "" ) {
+
+		if (img.depth()!=CV_8U or (img.channels()!=1 and img.channels()!=3)) return false;
+		{
+			Lock l(mtx);
+			Stream &s = streams[name];
+			s.listed = true;
+			if (not hasClients(s)) {
+				s.part.reset(); // stale by the time somebody connects
+				s.hash = 0;
+				return false;
+			}
+		}
+
+		// hash outside the lock, only the caller changes the stream's frames
+		uint64_t hash = getHash(img);
+		{ Lock l(mtx); if (streams[name].hash==hash) return false; }
+
 		img = img.clone();
 		Lock l(mtx);
-		timestamps[name] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-//		jpegs[name] = std::shared_future<std::string>(std::async(std::launch::deferred, [=](){ return uJpge::encode(img.data, img.cols, img.rows, q); }));
-		jpegs[name] = std::shared_future<std::string>(std::async(std::launch::deferred, [=](){ return getJPEG(img, q); }));
+		Stream &s = streams[name];
+		s.hash = hash;
+		uint64_t frame = ++s.frame;
+		for (auto &job : jobs) {
+			if (job.name!=name) continue;
+			job.frame = frame;
+			job.img = img;
+			return true;
+		}
+		jobs.push_back(Job{name, frame, img});
+		work.notify_one();
+		return true;
 	};
 };
-
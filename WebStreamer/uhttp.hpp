@@ -8,6 +8,8 @@
 #include <thread>
 #include <future>
 #include <mutex>
+#include <memory>
+#include <deque>
 
 #include <map>
 
@@ -15,60 +17,202 @@
 
 class UHTTP {
 public:
-	typedef std::function<void(boost::asio::ip::tcp::iostream &, std::string, std::string, std::string)> CB;
+
+	// A client connection. Requests are read and responses written asynchronously, so no thread is
+	// tied to a connection. State: READING (request) -> OPEN (handled, sending) -> CLOSING (flushing) -> CLOSED
+	// The socket and the timer are only used from the connection's strand, mtx guards the state and the queue.
+	class Connection : public std::enable_shared_from_this<Connection> {
+
+		friend class UHTTP;
+		typedef std::lock_guard<std::mutex> Lock;
+
+		enum State { READING, OPEN, CLOSING, CLOSED };
+
+		std::mutex mtx;
+		State state = READING;
+		boost::asio::io_service::strand strand;
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::steady_timer timer;
+		boost::asio::streambuf request;
+		char discard[256];
+
+		std::deque<std::pair<std::shared_ptr<const std::string>, bool>> queue; // data, replaceable by newer data
+		bool writing = false; // a write of the queue front is scheduled or in flight
+
+		// runs on the strand
+		void write() { // mtx held
+
+			if (queue.empty() or state==CLOSED) {
+				writing = false;
+				if (state==CLOSING) close();
+				return;
+			}
+			std::shared_ptr<const std::string> data = queue.front().first;
+			auto self = shared_from_this();
+			boost::asio::async_write(socket, boost::asio::buffer(*data), strand.wrap([this, self, data](const boost::system::error_code &error, size_t) {
+
+				Lock l(mtx);
+				if (state==CLOSED) { writing = false; return; }
+				queue.pop_front();
+				if (error or (queue.empty() and state==CLOSING)) { writing = false; return close(); }
+				write();
+			}));
+		}
+
+		// the client sends nothing after its request, reading only detects hang ups, runs on the strand
+		void watch() { // mtx held
+
+			auto self = shared_from_this();
+			socket.async_read_some(boost::asio::buffer(discard), strand.wrap([this, self](const boost::system::error_code &error, size_t) {
+
+				Lock l(mtx);
+				if (state==CLOSED) return;
+				if (error) return close();
+				watch();
+			}));
+		}
+
+		// runs on the strand
+		void close() { // mtx held
+
+			if (state==CLOSED) return;
+			state = CLOSED;
+			queue.clear();
+			boost::system::error_code ignored;
+			timer.cancel(ignored);
+			socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+			socket.close(ignored);
+		}
+
+	public:
+
+		Connection(boost::asio::io_service &io_service) : mtx(), strand(io_service), socket(io_service), timer(io_service), request(), queue() {}
+
+		// queue data to be sent, replaceable data is dropped if newer replaceable data is queued before it
+		// is sent (e.g. frames for slow clients). Returns false if the connection is gone. Safe from any thread.
+		bool send(std::shared_ptr<const std::string> data, bool replaceable = false) {
+
+			Lock l(mtx);
+			if (state!=OPEN) return false;
+			if (replaceable) {
+				auto it = queue.begin();
+				if (writing and it!=queue.end()) it++; // the front is being written
+				while (it!=queue.end()) it = it->second ? queue.erase(it) : it+1;
+			}
+			queue.emplace_back(data, replaceable);
+			if (not writing) {
+				writing = true;
+				auto self = shared_from_this();
+				strand.post([this, self](){ Lock l(mtx); write(); });
+			}
+			return true;
+		}
+
+		bool send(std::string data) { return send(std::make_shared<const std::string>(std::move(data))); }
+
+		// close after the queued data is sent, safe from any thread
+		void finish() {
+
+			Lock l(mtx);
+			if (state!=OPEN) return;
+			state = CLOSING;
+			if (writing) return; // the write handler closes once the queue is empty
+			auto self = shared_from_this();
+			strand.post([this, self](){ Lock l(mtx); close(); });
+		}
+
+		bool isOpen() { Lock l(mtx); return state==OPEN; }
+	};
+
+	typedef std::function<void(std::shared_ptr<Connection>, std::string, std::string, std::string)> CB;
 
 protected:
 
 	typedef std::lock_guard<std::mutex> Lock;
 	std::mutex mtx;
-	
+
 	boost::asio::io_service io_service;
 	boost::asio::ip::tcp::endpoint endpoint;
 	boost::asio::ip::tcp::acceptor acceptor;
-	
+
 	std::map<std::string,CB> cb;
 	std::vector<std::future<void>> f;
 
 	void start() {
-		
-		std::shared_ptr<boost::asio::ip::tcp::iostream> pNetStream(new boost::asio::ip::tcp::iostream);
-		
-		acceptor.async_accept(*pNetStream->rdbuf(), [=](const boost::system::error_code &error){ 
-
-			boost::asio::ip::tcp::iostream &net = *pNetStream;
-
-			if (error) return start();
-
-			std::string get, url, hostLabel, host;
-			if (not (net >>  get >> url)) return start();
-			if (url[0]!='/') return start();
-			if (get!="GET" and get!="POST") return start();
-			while ((net >> host) and host != "Host:");
-			if (host!="Host:") return start();
-			if (not (net >> host)) return start();
-			
+
+		auto c = std::make_shared<Connection>(io_service);
+		acceptor.async_accept(c->socket, [this, c](const boost::system::error_code &error){
+
+			if (error == boost::asio::error::operation_aborted) return;
+			start();
+			if (not error) c->strand.post([this, c](){ read(c); });
+		} );
+	}
+
+	// runs on the connection's strand
+	void read(std::shared_ptr<Connection> c) {
+
+		Lock l(c->mtx);
+		c->timer.expires_from_now(std::chrono::seconds(10));
+		c->timer.async_wait(c->strand.wrap([c](const boost::system::error_code &error){
+
+			Lock l(c->mtx);
+			if (not error and c->state==Connection::READING) c->close();
+		} ));
+
+		boost::asio::async_read_until(c->socket, c->request, "\r\n\r\n", c->strand.wrap([this, c](const boost::system::error_code &error, size_t){
+
+			std::string get, url, host;
+			{
+				Lock l(c->mtx);
+				if (c->state!=Connection::READING) return;
+				boost::system::error_code ignored;
+				c->timer.cancel(ignored);
+				if (error) return c->close();
+
+				std::istream net(&c->request);
+				if (not (net >> get >> url) or url[0]!='/' or (get!="GET" and get!="POST")) return c->close();
+				while ((net >> host) and host != "Host:");
+				if (host!="Host:" or not (net >> host)) return c->close();
+
+				c->state = Connection::OPEN;
+				c->watch();
+			}
+
 			std::string command = "";
 			if (url.find('/',1) != std::string::npos)
 				command = url.substr(1, url.find('/',1)-1);
 
-			CB c; {	Lock l(mtx); c = cb[command]; }
-			if (c) c(net, get, url, host);
-				
-			start();
-		} );
+			CB cmd; { Lock l(mtx); cmd = cb[command]; }
+			if (cmd) return cmd(c, get, url, host);
+
+			c->send("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+			c->finish();
+		} ));
 	}
 
 public:
 
-	UHTTP(int port = 80, int nworkers = 16) : 
-		endpoint(boost::asio::ip::tcp::v4(), port), 
+	UHTTP(int port = 80, int nworkers = 4) :
+		endpoint(boost::asio::ip::tcp::v4(), port),
 		acceptor(io_service, endpoint) {
-			for (int i=0; i<nworkers; i++) 
-				f.push_back(std::async(std::launch::async, [&](){start(); io_service.run();}));
+			start();
+			for (int i=0; i<nworkers; i++)
+				f.push_back(std::async(std::launch::async, [&](){io_service.run();}));
 		}
-		
-	~UHTTP() { io_service.stop(); }
-	
+
+	~UHTTP() { stop(); }
+
+	// stops serving and waits for the workers, derived classes must call it before their members go away
+	void stop() {
+
+		io_service.stop();
+		for (auto &w : f) if (w.valid()) w.wait();
+	}
+
+	// handlers are called from the worker threads and must not block, they answer through the connection
 	void operator()(std::string command, CB callback = CB()) { Lock l(mtx); cb[command] = callback; }
-};
 
+	// run a function on a worker thread
+	void post(std::function<void()> job) { io_service.post(job); }
+};
@@ -1,4 +1,5 @@
 #include "ZedCapture.h"
+#include "preview.h"
 #include <opencv2/imgproc.hpp>
 #include <string>
 #include <iostream>
@@ -51,7 +52,7 @@ ZedCapture::ZedCapture(BVS::ModuleInfo info, const BVS::Info& bvs)
     , mOutputMotionLost{"motionLost", BVS::ConnectorType::OUTPUT}
 
 {
-
+    if (mConfShowImages) Preview::instance().configure(bvs);
 
     //resolution
     sl::InitParameters initParams;
@@ -185,7 +186,8 @@ ZedCapture::ZedCapture(BVS::ModuleInfo info, const BVS::Info& bvs)
 
 // This is your module's destructor.
 ZedCapture::~ZedCapture() {
-
+    if (mConfShowImages)
+        for (auto window: {"imgLeft", "imgRight", "depthLeft", "depthRight"}) Preview::instance().close(window);
 }
 
 
@@ -235,12 +237,12 @@ BVS::Status ZedCapture::execute() {
 
             if (mConfShowImages)
             {
-                cv::Mat imgLeftClone = imageOcvLeft.clone();
-
-                //show current FPS in image
-                cv::putText(imgLeftClone, bvs.getFPS(), cv::Point(30,30), cv::FONT_HERSHEY_COMPLEX, 1.0, cv::Scalar(0,0,0), 2);
-                cv::namedWindow("imgLeft", CV_WINDOW_NORMAL);
-                cv::imshow("imgLeft", imgLeftClone);
+                //show current FPS in image, drawn by the preview's GUI thread
+                std::string fps = bvs.getFPS();
+                Preview::instance().show("imgLeft", imageOcvLeft, [fps](const cv::Mat& image, cv::Mat& shown) {
+                    image.copyTo(shown);
+                    cv::putText(shown, fps, cv::Point(30,30), cv::FONT_HERSHEY_COMPLEX, 1.0, cv::Scalar(0,0,0), 2);
+                });
             }
         }
 
@@ -255,12 +257,12 @@ BVS::Status ZedCapture::execute() {
 
             if (mConfShowImages)
             {
-                cv::Mat imgRightClone = imageOcvRight.clone();
-
-                //show current FPS in image
-                cv::putText(imgRightClone, bvs.getFPS(), cv::Point(30,30), cv::FONT_HERSHEY_COMPLEX, 1.0, cv::Scalar(0,0,0), 2);
-                cv::namedWindow("imgRight", CV_WINDOW_NORMAL);
-                cv::imshow("imgRight", imgRightClone);
+                //show current FPS in image, drawn by the preview's GUI thread
+                std::string fps = bvs.getFPS();
+                Preview::instance().show("imgRight", imageOcvRight, [fps](const cv::Mat& image, cv::Mat& shown) {
+                    image.copyTo(shown);
+                    cv::putText(shown, fps, cv::Point(30,30), cv::FONT_HERSHEY_COMPLEX, 1.0, cv::Scalar(0,0,0), 2);
+                });
             }
         }
 
@@ -282,8 +284,7 @@ BVS::Status ZedCapture::execute() {
 
             if (mConfShowImages)
             {
-                cv::namedWindow("depthLeft", CV_WINDOW_NORMAL);
-                cv::imshow("depthLeft", depthImgOcvLeft);
+                Preview::instance().show("depthLeft", depthImgOcvLeft);
             }
         }
 
@@ -303,8 +304,7 @@ BVS::Status ZedCapture::execute() {
 
             if (mConfShowImages)
             {
-                cv::namedWindow("depthRight", CV_WINDOW_NORMAL);
-                cv::imshow("depthRight", depthImgOcvRight);
+                Preview::instance().show("depthRight", depthImgOcvRight);
             }
         }
 
@@ -463,10 +463,6 @@ BVS::Status ZedCapture::execute() {
             }
         }
 
-
-        if (mConfShowImages) {
-            cv::waitKey(1);
-        }
     }
 
     mFrameCounter++;